@@ -4,6 +4,12 @@
 #include "com/ptr.h"
 #include "cor.h"
 
+template<>
+constexpr GUID com::guid_of<IOperandInstruction>() noexcept {
+    using namespace com::literals;
+    return "1F014299-F383-46CE-B7A6-1982C85F9FEA"_guid;
+}
+
 namespace clrie {
     struct instruction_graph : public com::ptr<IInstructionGraph> {
         // not strictly an up to spec iterator, but just enough for our purposes
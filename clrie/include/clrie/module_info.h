@@ -22,6 +22,12 @@ constexpr GUID com::guid_of<IMetaDataImport>() noexcept {
     return "{7DAC8207-D3AE-4c75-9B67-92801A497D44}"_guid;
 }
 
+template<>
+constexpr GUID com::guid_of<IMetaDataImport2>() noexcept {
+    using namespace com::literals;
+    return "{FCE5EFA0-8BBA-4f8e-A036-8F2022B08466}"_guid;
+}
+
 template<>
 constexpr GUID com::guid_of<IMetaDataAssemblyImport>() noexcept {
     using namespace com::literals;
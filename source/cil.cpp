@@ -1,3 +1,7 @@
+#include <doctest/doctest.h>
+
+#include <map>
+
 #include "cil.h"
 
 namespace appmap::cil {
@@ -7,6 +11,7 @@ using inseq = clrie::instruction_factory::instruction_sequence;
 struct compiler {
     const clrie::instruction_factory &factory;
     inseq insns;
+    std::map<int, clrie::instruction_factory::instruction> labels;
 
     compiler(const clrie::instruction_factory &factory): factory(factory) {}
 
@@ -16,6 +21,14 @@ struct compiler {
         return *this;
     }
 
+    // labels can be branched to before they're placed
+    clrie::instruction_factory::instruction label(int id) {
+        auto &ins = labels[id];
+        if (!ins)
+            ins = factory.create_instruction(Cee_Nop);
+        return ins;
+    }
+
     void operator()(ops::ldarg arg) {
         insns += factory.create_load_arg_instruction(arg.index);
     }
@@ -28,6 +41,10 @@ struct compiler {
         insns += factory.create_store_local_instruction(arg.index);
     }
 
+    void operator()(ops::label l) {
+        insns += label(l.id);
+    }
+
     void operator()(token_op op) {
         insns += factory.create_token_operand_instruction(op.op, op.token);
     }
@@ -36,6 +53,14 @@ struct compiler {
         insns += factory.create_long_operand_instruction(op.op, op.value);
     }
 
+    void operator()(int_op op) {
+        insns += factory.create_int_operand_instruction(op.op, op.value);
+    }
+
+    void operator()(branch_op op) {
+        insns += factory.create_branch_instruction(op.op, label(op.target));
+    }
+
     void operator()(op code) {
         insns += factory.create_instruction(code.op);
     }
@@ -54,4 +79,39 @@ clrie::instruction_factory::instruction_sequence compile(std::initializer_list<c
     return compile(gsl::make_span(code), factory);
 }
 
+#ifndef DOCTEST_CONFIG_DISABLE
+#include "com_mock.h"
+
+TEST_CASE("compiling branches to labels")
+{
+    using namespace ops;
+    ComMock<IInstructionFactory> factory;
+    ComMock<IInstruction> nop, load, branch, constant;
+    Method(factory, CreateInstruction) = &nop.get();
+    Method(factory, CreateLoadLocalInstruction) = &load.get();
+    Method(factory, CreateLongOperandInstruction) = &constant.get();
+
+    IInstruction *target = nullptr;
+    When(Method(factory, CreateBranchInstruction)).AlwaysDo([&](ILOrdinalOpcode, IInstruction *to, IInstruction **result) {
+        target = to;
+        *result = &branch.get();
+        return S_OK;
+    });
+
+    const std::vector<instruction> code = {
+        ldloc{3}, brfalse{1},
+        ldc{0x1122334455667788},
+        label{1}
+    };
+    const auto compiled = compile(code, clrie::instruction_factory(&factory.get()));
+
+    REQUIRE(compiled.size() == 4);
+    // the branch targets the label of the compiled code itself
+    CHECK(target == static_cast<IInstruction *>(compiled[3]));
+    CHECK(static_cast<IInstruction *>(compiled[1]) == &branch.get());
+    Verify(Method(factory, CreateLoadLocalInstruction).Using(3, fakeit::_)).Once();
+    Verify(Method(factory, CreateLongOperandInstruction).Using(Cee_Ldc_I8, 0x1122334455667788, fakeit::_)).Once();
+}
+#endif
+
 }
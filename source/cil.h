@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <variant>
 
 #include <gsl/gsl-lite.hpp>
@@ -22,18 +23,38 @@ struct long_op {
     uint64_t value;
 };
 
+struct int_op {
+    ILOrdinalOpcode op;
+    int32_t value;
+};
+
+// branches to the label with the id
+struct branch_op {
+    ILOrdinalOpcode op;
+    int target;
+};
+
 template <ILOrdinalOpcode Op>
 struct token_opcode: token_op {
     token_opcode(mdToken token): token_op{Op, token} {}
 };
 
+template <ILOrdinalOpcode Op>
+struct branch_opcode: branch_op {
+    branch_opcode(int target): branch_op{Op, target} {}
+};
+
 namespace ops {
     struct ldarg { int index; };
     struct ldloc { int index; };
     struct stloc { int index; };
 
+    // a nop marking a branch target
+    struct label { int id; };
+
 
     using ldfld = token_opcode<Cee_Ldfld>;
+    using ldflda = token_opcode<Cee_Ldflda>;
     using stfld = token_opcode<Cee_Stfld>;
     using ldftn = token_opcode<Cee_Ldftn>;
     using call = token_opcode<Cee_Call>;
@@ -41,10 +62,18 @@ namespace ops {
     using callvirt = token_opcode<Cee_Callvirt>;
     using newobj = token_opcode<Cee_Newobj>;
 
+    using br = branch_opcode<Cee_Br>;
+    using brfalse = branch_opcode<Cee_Brfalse>;
+    using brtrue = branch_opcode<Cee_Brtrue>;
+
     constexpr inline auto ldnull = op{Cee_Ldnull};
     constexpr inline auto pop = op{Cee_Pop};
     constexpr inline auto dup = op{Cee_Dup};
 
+    struct ldc_i4: int_op {
+        ldc_i4(int32_t val): int_op{Cee_Ldc_I4, val} {}
+    };
+
     struct ldc: long_op {
         ldc(uint64_t val): long_op{Cee_Ldc_I8, val} {}
 
@@ -53,7 +82,10 @@ namespace ops {
     };
 }
 
-using instruction = std::variant<ops::ldarg, ops::ldloc, ops::stloc, op, token_op, long_op>;
+using instruction = std::variant<
+    ops::ldarg, ops::ldloc, ops::stloc, ops::label,
+    op, token_op, long_op, int_op, branch_op
+>;
 
 clrie::instruction_factory::instruction_sequence compile(const gsl::span<const instruction> code, const clrie::instruction_factory &factory);
 clrie::instruction_factory::instruction_sequence compile(std::initializer_list<const instruction> code, const clrie::instruction_factory &factory);
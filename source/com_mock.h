@@ -0,0 +1,73 @@
+#pragma once
+
+// Mocks of COM interfaces for the tests, only to be included when testing is enabled.
+
+#include <fakeit.hpp>
+#include <utf8.h>
+
+#include <tuple>
+#include <type_traits>
+
+template <typename... Ts>
+struct select_last
+{
+    template<typename T>
+    struct tag
+    {
+        using type = T;
+    };
+
+    // Use a fold-expression to fold the comma operator over the parameter pack.
+    using type = typename decltype((tag<Ts>{}, ...))::type;
+};
+
+template <typename C>
+struct ComMock : public fakeit::Mock<C>
+{
+    ComMock() {
+        Fake(Method((*this), AddRef), Method((*this), Release));
+        Method((*this), QueryInterface) = &this->get();
+    }
+
+    template <typename... arglist>
+    struct ComMockingContext : public fakeit::MockingContext<HRESULT, arglist...>
+    {
+        ComMockingContext(fakeit::MockingContext<HRESULT, arglist...> &&mc)
+        : fakeit::MockingContext<HRESULT, arglist...>(std::move(mc)) {}
+
+        using result_type = std::remove_pointer_t<typename select_last<arglist...>::type>;
+
+        void operator=(const result_type &r) {
+            auto method = [r](auto &&...args) {
+                *std::get<sizeof...(arglist) - 1>(std::make_tuple(args...)) = r;
+                return S_OK;
+            };
+            fakeit::MethodMockingContext<HRESULT, arglist...>::setMethodBodyByAssignment(method);
+        }
+
+        void operator=(const char *r) {
+            auto method = [str = utf8::utf8to16(r)](auto &&...args) {
+                *std::get<sizeof...(arglist) - 1>(std::make_tuple(args...)) = SysAllocString(str.data());
+                return S_OK;
+            };
+            fakeit::MethodMockingContext<HRESULT, arglist...>::setMethodBodyByAssignment(method);
+        }
+
+        ComMockingContext<arglist...> &setMethodDetails(std::string mockName, std::string methodName) {
+            fakeit::MethodMockingContext<HRESULT, arglist...>::setMethodDetails(mockName, methodName);
+            return *this;
+        }
+    };
+
+    template <int id, typename R, typename T, typename... arglist>
+    requires std::is_base_of_v<T, C>
+    fakeit::MockingContext<R, arglist...> stub(R(T::*vMethod)(arglist...)) {
+        return this->fakeit::Mock<C>::template stub<id>(vMethod);
+    }
+
+    template <int id, typename T, typename... arglist>
+    requires std::is_base_of_v<T, C> && std::is_pointer_v<typename select_last<arglist...>::type>
+    ComMockingContext<arglist...> stub(HRESULT(T::*vMethod)(arglist...)) {
+        return this->fakeit::Mock<C>::template stub<id>(vMethod);
+    }
+};
@@ -0,0 +1,74 @@
+#include <doctest/doctest.h>
+
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "concurrent.h"
+
+using namespace appmap;
+
+TEST_CASE("concurrent map")
+{
+    concurrent_map<std::string, int, std::hash<std::string_view>> map;
+    CHECK(map.find(std::string_view("missing")) == nullptr);
+
+    for (int i = 0; i < 100; i++)
+        map.insert_or_assign(std::to_string(i), i);
+
+    const auto *seven = map.find(std::string_view("7"));
+    REQUIRE(seven);
+    CHECK(*seven == 7);
+
+    map.insert_or_assign("7", 77);
+    CHECK(*map.find(std::string_view("7")) == 77);
+    CHECK(*seven == 7);  // still valid
+
+    int count = 0;
+    map.for_each([&count](const std::string &, int) { count++; });
+    CHECK(count == 100);
+
+    SUBCASE("lookups during inserts") {
+        std::atomic<bool> done = false;
+        std::thread writer([&map, &done]() {
+            for (int i = 100; i < 10000; i++)
+                map.insert_or_assign(std::to_string(i), i);
+            done = true;
+        });
+
+        bool consistent = true;
+        while (!done)
+            for (int i = 0; i < 100; i += 9)
+                if (const auto *v = map.find(std::to_string(i)); !v || (*v != i && !(i == 7 && *v == 77)))
+                    consistent = false;
+        writer.join();
+
+        CHECK(consistent);
+        CHECK(*map.find(std::string_view("9999")) == 9999);
+    }
+}
+
+TEST_CASE("segmented vector")
+{
+    segmented_vector<std::string, 4> vector;
+    CHECK(vector.push_back("zero") == 0);
+    CHECK(vector.push_back("one") == 1);
+
+    const auto &zero = vector[0];
+    std::vector<std::thread> writers;
+    std::vector<std::vector<size_t>> indices(4);
+    for (size_t t = 0; t < indices.size(); t++)
+        writers.emplace_back([&vector, &indices, t]() {
+            for (size_t i = 0; i < 1000; i++)
+                indices[t].push_back(vector.push_back(std::to_string(t) + ":" + std::to_string(i)));
+        });
+    for (auto &writer: writers)
+        writer.join();
+
+    CHECK(vector.size() == 4002);
+    CHECK(&vector[0] == &zero);  // never moves
+    for (size_t t = 0; t < indices.size(); t++)
+        for (size_t i = 0; i < 1000; i++)
+            CHECK(vector.at(indices[t][i]) == std::to_string(t) + ":" + std::to_string(i));
+    CHECK_THROWS_AS(vector.at(4002), std::out_of_range);
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace appmap {
+    // Spreads the bits of a packed key so that the low ones can index a table.
+    constexpr uint64_t hash_mix(uint64_t x) noexcept
+    {
+        x ^= x >> 30; x *= 0xbf58476d1ce4e5b9;
+        x ^= x >> 27; x *= 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    }
+
+    // Hash map for things looked up from many threads at once (eg. by the JIT),
+    // but only added once in a while. Lookups are lock-free and never block on inserts,
+    // which are serialized. Entries and outgrown tables are only freed with the map,
+    // so a value found once stays valid and readers never see freed memory.
+    template <typename Key, typename Value, typename Hash = std::hash<Key>>
+    class concurrent_map
+    {
+        struct entry {
+            uint64_t hash;
+            Key key;
+            Value value;
+        };
+
+        struct table {
+            explicit table(size_t size): mask(size - 1), slots(new std::atomic<const entry *>[size]()) {}
+            const size_t mask;
+            std::unique_ptr<std::atomic<const entry *>[]> slots;
+        };
+
+        std::atomic<const table *> current = nullptr;
+
+        std::mutex mutex;  // guards everything below
+        std::vector<std::unique_ptr<const table>> tables;
+        std::vector<std::unique_ptr<const entry>> entries;
+        size_t count = 0;
+
+        // Returns true if the key wasn't in the table yet.
+        static bool place(const table &t, const entry *e) noexcept
+        {
+            for (auto i = e->hash;; i++) {
+                auto &slot = t.slots[i & t.mask];
+                const auto *other = slot.load(std::memory_order_relaxed);
+                if (!other || (other->hash == e->hash && other->key == e->key)) {
+                    slot.store(e, std::memory_order_release);
+                    return !other;
+                }
+            }
+        }
+
+        const table &grow()
+        {
+            const auto *old = current.load(std::memory_order_relaxed);
+            auto &t = *tables.emplace_back(std::make_unique<table>(old ? (old->mask + 1) * 2 : 16));
+            if (old)
+                for (size_t i = 0; i <= old->mask; i++)
+                    if (const auto *e = old->slots[i].load(std::memory_order_relaxed))
+                        place(t, e);
+            current.store(&t, std::memory_order_release);
+            return t;
+        }
+
+    public:
+        // Key can be anything Hash takes and Key compares equal to, eg. a string_view for string keys.
+        template <typename K>
+        const Value *find(const K &key) const noexcept
+        {
+            const auto *t = current.load(std::memory_order_acquire);
+            if (!t)
+                return nullptr;
+
+            const uint64_t hash = Hash{}(key);
+            for (auto i = hash;; i++) {
+                const auto *e = t->slots[i & t->mask].load(std::memory_order_acquire);
+                if (!e)
+                    return nullptr;
+                if (e->hash == hash && e->key == key)
+                    return &e->value;
+            }
+        }
+
+        // Replaced values are kept alive too, so they stay valid for whoever found them.
+        const Value &insert_or_assign(Key key, Value value)
+        {
+            const uint64_t hash = Hash{}(key);
+            std::lock_guard lock(mutex);
+
+            const auto *e = entries.emplace_back(new entry{hash, std::move(key), std::move(value)}).get();
+            const auto *t = current.load(std::memory_order_relaxed);
+            // keep at most half of the slots full, so that probe sequences stay short
+            if (!t || (count + 1) * 2 > t->mask + 1)
+                t = &grow();
+            if (place(*t, e))
+                count++;
+            return e->value;
+        }
+
+        // Sees entries added concurrently or not, but doesn't block.
+        template <typename F>
+        void for_each(F f) const
+        {
+            const auto *t = current.load(std::memory_order_acquire);
+            if (!t)
+                return;
+            for (size_t i = 0; i <= t->mask; i++)
+                if (const auto *e = t->slots[i].load(std::memory_order_acquire))
+                    f(e->key, e->value);
+        }
+    };
+
+    // Vector that only ever grows, in fixed-size chunks that never move,
+    // so elements can be added while other threads read without any locks,
+    // and an index stays valid as long as the vector does.
+    // An element is only safe to read by threads that got its index
+    // from the one that added it (eg. through compiled code), not just by guessing.
+    template <typename T, size_t ChunkSize = 1024, size_t MaxChunks = 16384>
+    class segmented_vector
+    {
+        std::atomic<size_t> count = 0;
+        std::array<std::atomic<T *>, MaxChunks> chunks{};
+
+        T &slot(size_t index) const noexcept
+        {
+            return chunks[index / ChunkSize].load(std::memory_order_acquire)[index % ChunkSize];
+        }
+
+    public:
+        segmented_vector() = default;
+        segmented_vector(const segmented_vector &) = delete;
+        ~segmented_vector()
+        {
+            for (auto &chunk: chunks)
+                delete[] chunk.load(std::memory_order_relaxed);
+        }
+
+        // Returns the index of the new element.
+        size_t push_back(T value)
+        {
+            const auto index = count.fetch_add(1, std::memory_order_relaxed);
+            if (index / ChunkSize >= MaxChunks)
+                throw std::length_error("segmented_vector is full");
+
+            auto &chunk = chunks[index / ChunkSize];
+            if (!chunk.load(std::memory_order_acquire)) {
+                // whoever gets there first installs it
+                T *expected = nullptr;
+                auto *fresh = new T[ChunkSize];
+                if (!chunk.compare_exchange_strong(expected, fresh, std::memory_order_acq_rel))
+                    delete[] fresh;
+            }
+
+            slot(index) = std::move(value);
+            return index;
+        }
+
+        // Number of indices handed out, including elements still being added.
+        size_t size() const noexcept { return count.load(std::memory_order_relaxed); }
+
+        const T &operator[](size_t index) const noexcept { return slot(index); }
+        const T &at(size_t index) const
+        {
+            if (index >= size())
+                throw std::out_of_range("segmented_vector index out of range");
+            return slot(index);
+        }
+    };
+}
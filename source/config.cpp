@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <array>
 #include <doctest/doctest.h>
 #include <spdlog/spdlog.h>
 #include <yaml-cpp/yaml.h>
@@ -6,6 +7,8 @@
 #include <spdlog/fmt/bundled/ostream.h>
 #include <fstream>
 #include <cstdio>
+#include <map>
+#include <unordered_set>
 
 #include "config.h"
 
@@ -14,18 +17,60 @@ using namespace appmap;
 
 struct config::instrumentation_filter {
     virtual ~instrumentation_filter() {}
+
+    // Name filters are only matched one by one if some of their excludes
+    // are module or path filters, see filter_set.
     virtual bool match(
-        clrie::method_info method
+        [[maybe_unused]] clrie::module_info module,
+        [[maybe_unused]] std::string_view name
     ) const noexcept
     {
-        for (const auto &ex: excludes)
-            if (ex->match(method))
-                return false;
+        return false;
+    }
 
-        return true;
+    // Does the filter match the whole module, excludes notwithstanding?
+    virtual bool match_module([[maybe_unused]] clrie::module_info module) const noexcept
+    {
+        return false;
     }
 
     filter_list excludes;
+    std::shared_ptr<const filter_set> excluded;  // excludes compiled, if any
+};
+
+// A filter list compiled for matching. Name filters, along with their nested excludes, are merged
+// into a single prefix tree over dotted names, with the verdict resolved on the tree nodes;
+// deciding a name takes one walk down the tree. Module and path filters are matched in turn.
+// If any of them is nested in a name filter, names can't be decided by the tree alone, so the
+// name filters are matched one by one instead, and the tree only gives a conservative verdict
+// for modules.
+struct config::filter_set {
+    explicit filter_set(const filter_list &filters);
+
+    // name is the full name of a method in the module
+    bool match(clrie::module_info module, std::string_view name) const noexcept;
+    module_verdict match_module(clrie::module_info module) const;
+
+private:
+    struct node {
+        std::map<std::string, node, std::less<>> children;  // by name segment
+        std::vector<const instrumentation_filter *> filters;  // name filters ending here
+        std::optional<bool> verdict;  // only set on nodes where some filter ends
+        bool any_included = false;  // here or anywhere below
+    };
+
+    using active_set = std::unordered_set<const instrumentation_filter *>;
+
+    void insert(const filter_list &filters, bool nested);
+    void resolve(node &n, const filter_list &filters, active_set &active);
+    bool match_name(std::string_view name) const noexcept;
+    bool may_match_type(std::string_view type_name) const noexcept;
+    bool may_match_any_type(clrie::module_info module) const;
+
+    node names;
+    std::vector<const instrumentation_filter *> module_filters;
+    std::vector<const instrumentation_filter *> name_filters;  // top-level ones
+    bool module_dependent = false;  // some module or path filter is nested in a name filter
 };
 
 namespace {
@@ -75,17 +120,36 @@ namespace {
             return find_file("appmap.yml", basepath);
     }
 
+    // Is the dotted name equal to or nested inside the prefix?
+    bool is_within(std::string_view name, std::string_view prefix)
+    {
+        const auto len = prefix.length();
+
+        if (len > name.length()) return false;
+
+        return name.starts_with(prefix) && (
+            name.length() == len ||
+            name[len] == '.'
+        );
+    }
+
     struct module_name_filter : config::instrumentation_filter {
         std::string name;
 
         module_name_filter(std::string filter): name(std::move(filter)) {}
 
         bool match(
-            clrie::method_info method
+            clrie::module_info module,
+            std::string_view method_name
         ) const noexcept override
         {
-            return method.module_info().module_name() == name
-                && instrumentation_filter::match(method);
+            return match_module(module)
+                && !(excluded && excluded->match(module, method_name));
+        }
+
+        bool match_module(clrie::module_info module) const noexcept override
+        {
+            return module.module_name() == name;
         }
     };
 
@@ -95,15 +159,19 @@ namespace {
         module_path_filter(fs::path filter): path(std::move(filter)) {}
 
         bool match(
-            clrie::method_info method
+            clrie::module_info module,
+            std::string_view method_name
         ) const noexcept override
         {
-            const fs::path module_path = method.module_info().full_path();
-
-            if (const auto &[end, _] = std::mismatch(path.begin(), path.end(), module_path.begin()); end == path.end())
-                return instrumentation_filter::match(method);
+            return match_module(module)
+                && !(excluded && excluded->match(module, method_name));
+        }
 
-            return false;
+        bool match_module(clrie::module_info module) const noexcept override
+        {
+            const fs::path module_path = module.full_path();
+            const auto &[end, _] = std::mismatch(path.begin(), path.end(), module_path.begin(), module_path.end());
+            return end == path.end();
         }
     };
 
@@ -113,24 +181,205 @@ namespace {
         name_filter(std::string filter): name(std::move(filter)) {}
 
         bool match(
-            clrie::method_info method
+            clrie::module_info module,
+            std::string_view method_name
         ) const noexcept override
         {
-            const auto full_name = method.full_name();
-            const auto len = name.length();
+            if (!is_within(method_name, name))
+                return false;
 
-            if (len > full_name.length()) return false;
+            for (const auto &ex: excludes)
+                if (ex->match(module, method_name))
+                    return false;
 
-            if (full_name.rfind(name, 0) == 0 && (
-                full_name.length() == len ||
-                full_name[len] == '.'
-            ))
-                return instrumentation_filter::match(method);
+            return true;
+        }
+    };
 
+    // Does the filter, with its excludes, apply to a name that all the active name filters contain?
+    // Module and path filters are never active; they can't be decided by name alone.
+    bool applies(const config::instrumentation_filter &filter, const std::unordered_set<const config::instrumentation_filter *> &active)
+    {
+        if (active.find(&filter) == active.end())
             return false;
+
+        for (const auto &ex: filter.excludes)
+            if (applies(*ex, active))
+                return false;
+
+        return true;
+    }
+
+}
+
+config::filter_set::filter_set(const filter_list &filters)
+{
+    insert(filters, false);
+
+    active_set active;
+    resolve(names, filters, active);
+}
+
+void config::filter_set::insert(const filter_list &filters, bool nested)
+{
+    for (const auto &filter: filters) {
+        const auto *by_name = dynamic_cast<const name_filter *>(filter.get());
+        if (!by_name) {
+            if (!filter->excludes.empty())
+                filter->excluded = std::make_shared<const filter_set>(filter->excludes);
+            if (nested)
+                module_dependent = true;
+            else
+                module_filters.push_back(filter.get());
+            continue;
         }
-    };
 
+        if (!nested)
+            name_filters.push_back(filter.get());
+
+        node *n = &names;
+        std::string_view name = by_name->name;
+        for (auto dot = name.find('.'); ; dot = name.find('.')) {
+            n = &n->children.try_emplace(std::string(name.substr(0, dot))).first->second;
+            if (dot == name.npos)
+                break;
+            name.remove_prefix(dot + 1);
+        }
+        n->filters.push_back(filter.get());
+
+        insert(filter->excludes, true);
+    }
+}
+
+// The verdict can only change on nodes where some name filter ends; everywhere
+// else it is inherited from the closest such ancestor.
+void config::filter_set::resolve(node &n, const filter_list &filters, active_set &active)
+{
+    active.insert(n.filters.begin(), n.filters.end());
+
+    if (!n.filters.empty())
+        n.verdict = std::any_of(filters.begin(), filters.end(), [&active](const auto &f) { return applies(*f, active); });
+
+    // a filter ending here might apply in some module even if it doesn't by name
+    n.any_included = n.verdict.value_or(false) || (module_dependent && !n.filters.empty());
+    for (auto &[_, child]: n.children) {
+        resolve(child, filters, active);
+        n.any_included |= child.any_included;
+    }
+
+    for (const auto *f: n.filters)
+        active.erase(f);
+}
+
+bool config::filter_set::match_name(std::string_view name) const noexcept
+{
+    const node *n = &names;
+    bool verdict = false;
+
+    for (auto dot = name.find('.'); ; dot = name.find('.')) {
+        const auto child = n->children.find(name.substr(0, dot));
+        if (child == n->children.end())
+            break;
+
+        n = &child->second;
+        if (n->verdict)
+            verdict = *n->verdict;
+
+        if (dot == name.npos)
+            break;
+        name.remove_prefix(dot + 1);
+    }
+
+    return verdict;
+}
+
+// Conservative: can a name filter match a method of the (top-level) type, or of types nested in it?
+bool config::filter_set::may_match_type(std::string_view name) const noexcept
+{
+    const node *n = &names;
+
+    for (auto dot = name.find('.'); dot != name.npos; dot = name.find('.')) {
+        const auto child = n->children.find(name.substr(0, dot));
+        if (child == n->children.end())
+            return false;
+
+        n = &child->second;
+        if (n->verdict == true || (module_dependent && !n->filters.empty()))
+            return true;
+
+        name.remove_prefix(dot + 1);
+    }
+
+    // names of nested types continue after a + or /
+    for (auto it = n->children.lower_bound(name); it != n->children.end() && it->first.starts_with(name); ++it) {
+        const auto rest = std::string_view(it->first).substr(name.size());
+        if ((rest.empty() || rest[0] == '+' || rest[0] == '/') && it->second.any_included)
+            return true;
+    }
+
+    return false;
+}
+
+bool config::filter_set::may_match_any_type(clrie::module_info module) const
+{
+    const auto import = module.meta_data_import();
+    HCORENUM it = nullptr;
+    bool result = false;
+
+    std::array<mdTypeDef, 64> types;
+    ULONG count;
+    while (!result && import->EnumTypeDefs(&it, types.data(), types.size(), &count) == S_OK && count > 0) {
+        for (ULONG i = 0; i < count && !result; i++) {
+            char16_t name[1024];
+            DWORD flags;
+            if (import->GetTypeDefProps(types[i], name, 1024, nullptr, &flags, nullptr) != S_OK || IsTdNested(flags))
+                continue;
+            result = may_match_type(utf8::utf16to8(std::u16string(name)));
+        }
+    }
+
+    if (it)
+        import->CloseEnum(it);
+
+    return result;
+}
+
+module_verdict config::filter_set::match_module(clrie::module_info module) const
+{
+    auto verdict = module_verdict::excluded;
+
+    for (const auto *filter: module_filters) {
+        if (filter->match_module(module)) {
+            if (!filter->excluded)
+                return module_verdict::included;
+            verdict = module_verdict::per_method;
+        }
+    }
+
+    if (verdict == module_verdict::excluded && names.any_included && may_match_any_type(module))
+        verdict = module_verdict::per_method;
+
+    return verdict;
+}
+
+bool config::filter_set::match(clrie::module_info module, std::string_view name) const noexcept
+{
+    if (module_dependent) {
+        for (const auto *filter: name_filters)
+            if (filter->match(module, name))
+                return true;
+    } else if (match_name(name)) {
+        return true;
+    }
+
+    for (const auto *filter: module_filters)
+        if (filter->match(module, name))
+            return true;
+
+    return false;
+}
+
+namespace {
     fs::path resolve(const fs::path &path, const fs::path &base) {
         if (!path.is_relative())
             return path;
@@ -179,10 +428,79 @@ namespace {
     }
 
 
+    std::optional<capture_policy> parse_capture_policy(const std::string &name)
+    {
+        if (name == "none")
+            return capture_policy::none;
+        if (name == "type-only")
+            return capture_policy::type_only;
+        if (name == "identity")
+            return capture_policy::identity;
+        if (name == "primitive-only")
+            return capture_policy::primitive_only;
+        if (name == "tostring")
+            return capture_policy::tostring;
+
+        spdlog::warn("unrecognized capture policy in config file: {}", name);
+        return std::nullopt;
+    }
+
+    void load_capture(appmap::config &c, const YAML::Node &rules)
+    {
+        for (const auto &rule: rules) {
+            const auto &policy_node = rule["policy"];
+            if (!rule.IsMap() || !policy_node) {
+                spdlog::warn("unrecognized capture specification in config file: {}", rule);
+                continue;
+            }
+
+            const auto policy = parse_capture_policy(policy_node.as<std::string>());
+            if (!policy)
+                continue;
+
+            if (const auto &type = rule["type"])
+                c.type_capture[type.as<std::string>()] = *policy;
+            else if (const auto &cls = rule["class"])
+                c.class_capture[cls.as<std::string>()] = *policy;
+            else if (const auto &pkg = rule["package"])
+                c.package_capture.emplace_back(pkg.as<std::string>(), *policy);
+            else
+                c.default_capture = *policy;
+        }
+    }
+
     void load_config(appmap::config &c, const YAML::Node &config_file)
     {
-        if (const auto &pkgs = config_file["packages"])
+        if (const auto &pkgs = config_file["packages"]) {
             c.filters = load_filters(pkgs, c.base_path);
+            c.compiled_filters = std::make_shared<const config::filter_set>(c.filters);
+        }
+        if (const auto &capture = config_file["capture"])
+            load_capture(c, capture);
+        if (const auto &max_length = config_file["max_string_length"])
+            c.max_string_length = max_length.as<int32_t>();
+        if (const auto &max_elements = config_file["max_collection_elements"])
+            c.max_collection_elements = max_elements.as<int32_t>();
+        if (const auto &trivial = config_file["skip_trivial"]) {
+            if (const auto &size = trivial["max_il_size"])
+                c.skip_trivial.max_il_size = size.as<uint32_t>();
+            if (const auto &accessors = trivial["accessors"])
+                c.skip_trivial.accessors = accessors.as<bool>();
+            if (const auto &inlining = trivial["aggressive_inlining"])
+                c.skip_trivial.aggressive_inlining = inlining.as<bool>();
+        }
+        if (const auto &depth = config_file["max_depth"])
+            c.max_depth = depth.as<uint32_t>();
+        if (const auto &recursion = config_file["max_recursion"])
+            c.max_recursion = recursion.as<uint32_t>();
+        if (const auto &repeats = config_file["max_repeats"])
+            c.max_repeats = repeats.as<uint32_t>();
+        if (const auto &duration = config_file["min_duration"])
+            c.min_duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double, std::micro>(duration.as<double>()));
+        if (const auto &attributes = config_file["exclude_attributes"])
+            for (const auto &attribute: attributes)
+                c.exclude_attributes.push_back(utf8::utf8to16(attribute.as<std::string>()));
     }
 
     appmap::config load_default()
@@ -204,7 +522,9 @@ namespace {
         if (const auto config_path = config_file_path(basepath.value_or(fs::current_path()))) {
             if (!basepath)
                 c.base_path = (*config_path).parent_path();
-            load_config(c, YAML::LoadFile(*config_path));
+            const auto config_file = YAML::LoadFile(*config_path);
+            load_config(c, config_file);
+            c.fingerprint = std::hash<std::string>{}(YAML::Dump(config_file) + '\n' + c.base_path.string());
         } else {
             spdlog::critical("appmap configuration file not found");
         }
@@ -263,13 +583,145 @@ appmap::config & appmap::config::instance()
     return c;
 }
 
-bool appmap::config::should_instrument(clrie::method_info method)
+bool appmap::config::should_instrument(clrie::method_info method) const
 {
-    for (const auto &f: filters)
-        if (f->match(method))
-            return true;
+    return should_instrument(method.module_info(), method.full_name());
+}
 
-    return false;
+bool appmap::config::should_instrument(clrie::module_info module, std::string_view method_name) const
+{
+    return compiled_filters && compiled_filters->match(module, method_name);
+}
+
+module_verdict appmap::config::should_instrument(clrie::module_info module) const
+{
+    if (!compiled_filters)
+        return module_verdict::excluded;
+
+    return compiled_filters->match_module(module);
+}
+
+capture_policy appmap::config::value_capture(const std::string &class_name, const std::string &type_name) const noexcept
+{
+    if (const auto it = type_capture.find(type_name); it != type_capture.end())
+        return it->second;
+
+    if (const auto it = class_capture.find(class_name); it != class_capture.end())
+        return it->second;
+
+    const std::pair<std::string, capture_policy> *best = nullptr;
+    for (const auto &rule: package_capture)
+        if (is_within(class_name, rule.first) && (!best || rule.first.length() > best->first.length()))
+            best = &rule;
+
+    return best ? best->second : default_capture;
+}
+
+capture_policy appmap::config::receiver_capture(const std::string &class_name) const noexcept
+{
+    if (const auto it = type_capture.find(class_name); it != type_capture.end())
+        return it->second == capture_policy::none ? capture_policy::type_only : it->second;
+
+    switch (value_capture(class_name, {})) {
+        case capture_policy::identity:
+        case capture_policy::tostring:
+            return capture_policy::identity;
+        default:
+            return capture_policy::type_only;
+    }
+}
+
+TEST_CASE("capture policy") {
+    config c;
+    load_config(c, YAML::Load(R"(
+        capture:
+        - type: MyProject.Money
+          policy: tostring
+        - type: MyProject.Order
+          policy: identity
+        - type: MyProject.Broken
+          policy: bogus
+        - package: MyProject.Batch
+          policy: type-only
+        - package: MyProject.Batch.Reports
+          policy: primitive-only
+        - class: MyProject.Batch.Reports.Printer
+          policy: none
+    )"));
+
+    SUBCASE("of receivers") {
+        CHECK(c.receiver_capture("MyProject.Money") == capture_policy::tostring);
+        CHECK(c.receiver_capture("MyProject.Order") == capture_policy::identity);
+        CHECK(c.receiver_capture("MyProject.Broken") == capture_policy::identity);
+        CHECK(c.receiver_capture("MyProject.Other") == capture_policy::identity);
+        CHECK(c.receiver_capture("MyProject.Batch.Job") == capture_policy::type_only);
+        CHECK(c.receiver_capture("MyProject.Batch.Reports.Printer") == capture_policy::type_only);
+    }
+
+    SUBCASE("of values") {
+        CHECK(c.value_capture("MyProject.Other", "System.String") == capture_policy::tostring);
+        CHECK(c.value_capture("MyProject.Batch.Job", "System.String") == capture_policy::type_only);
+        CHECK(c.value_capture("MyProject.Batch.Job", "MyProject.Money") == capture_policy::tostring);
+        CHECK(c.value_capture("MyProject.Batches.Job", "System.String") == capture_policy::tostring);
+        CHECK(c.value_capture("MyProject.Batch.Reports.Daily", "System.String") == capture_policy::primitive_only);
+        CHECK(c.value_capture("MyProject.Batch.Reports.Printer", "System.String") == capture_policy::none);
+    }
+
+    SUBCASE("default") {
+        load_config(c, YAML::Load("capture: [policy: none]"));
+        CHECK(c.value_capture("MyProject.Other", "System.String") == capture_policy::none);
+        CHECK(c.receiver_capture("MyProject.Other") == capture_policy::type_only);
+    }
+}
+
+TEST_CASE("trivial method policy") {
+    config c;
+    CHECK(!c.skip_trivial.any());
+
+    load_config(c, YAML::Load(R"(
+        skip_trivial:
+          max_il_size: 8
+          accessors: true
+    )"));
+    CHECK(c.skip_trivial.any());
+    CHECK(c.skip_trivial.max_il_size == 8);
+    CHECK(c.skip_trivial.accessors);
+    CHECK(!c.skip_trivial.aggressive_inlining);
+}
+
+TEST_CASE("call depth limits") {
+    config c;
+    CHECK(c.max_depth == 0);
+    CHECK(c.max_recursion == 0);
+
+    load_config(c, YAML::Load("{max_depth: 50, max_recursion: 3}"));
+    CHECK(c.max_depth == 50);
+    CHECK(c.max_recursion == 3);
+    CHECK(c.max_repeats == 0);
+
+    load_config(c, YAML::Load("{max_repeats: 10}"));
+    CHECK(c.max_repeats == 10);
+}
+
+TEST_CASE("minimum duration") {
+    config c;
+    CHECK(c.min_duration.count() == 0);
+
+    load_config(c, YAML::Load("{min_duration: 2.5}"));
+    CHECK(c.min_duration == std::chrono::nanoseconds(2500));
+}
+
+TEST_CASE("attribute excludes") {
+    config c;
+    load_config(c, YAML::Load(R"(
+        exclude_attributes:
+        - System.Runtime.CompilerServices.CompilerGeneratedAttribute
+        - MyProject.AppMapIgnoreAttribute
+    )"));
+    CHECK(c.exclude_attributes == std::vector<std::u16string>{
+        u"System.Runtime.CompilerServices.CompilerGeneratedAttribute",
+        u"MyProject.AppMapIgnoreAttribute"
+    });
 }
 
 std::filesystem::path appmap::config::appmap_output_dir() const noexcept
@@ -303,77 +755,13 @@ std::pair<std::unique_ptr<std::ostream>, std::filesystem::path> appmap::config::
 }
 
 #ifndef DOCTEST_CONFIG_DISABLE
-#include <fakeit.hpp>
+#include "com_mock.h"
 using namespace fakeit;
 
 REGISTER_EXCEPTION_TRANSLATOR(fakeit::FakeitException &ex) {
     return ex.what().c_str();
 }
 
-template <typename... Ts>
-struct select_last
-{
-    template<typename T>
-    struct tag
-    {
-        using type = T;
-    };
-
-    // Use a fold-expression to fold the comma operator over the parameter pack.
-    using type = typename decltype((tag<Ts>{}, ...))::type;
-};
-
-template <typename C>
-struct ComMock : public Mock<C>
-{
-    ComMock() {
-        Fake(Method((*this), AddRef), Method((*this), Release));
-        Method((*this), QueryInterface) = &this->get();
-    }
-
-    template <typename... arglist>
-    struct ComMockingContext : public MockingContext<HRESULT, arglist...>
-    {
-        ComMockingContext(MockingContext<HRESULT, arglist...> &&mc)
-        : MockingContext<HRESULT, arglist...>(std::move(mc)) {}
-
-        using result_type = std::remove_pointer_t<typename select_last<arglist...>::type>;
-
-        void operator=(const result_type &r) {
-            auto method = [r](auto &&...args) {
-                *std::get<sizeof...(arglist) - 1>(std::make_tuple(args...)) = r;
-                return S_OK;
-            };
-            MethodMockingContext<HRESULT, arglist...>::setMethodBodyByAssignment(method);
-        }
-
-        void operator=(const char *r) {
-            auto method = [str = utf8::utf8to16(r)](auto &&...args) {
-                *std::get<sizeof...(arglist) - 1>(std::make_tuple(args...)) = SysAllocString(str.data());
-                return S_OK;
-            };
-            MethodMockingContext<HRESULT, arglist...>::setMethodBodyByAssignment(method);
-        }
-
-        ComMockingContext<arglist...> &setMethodDetails(std::string mockName, std::string methodName) {
-            MethodMockingContext<HRESULT, arglist...>::setMethodDetails(mockName, methodName);
-            return *this;
-        }
-    };
-
-    template <int id, typename R, typename T, typename... arglist>
-    requires std::is_base_of_v<T, C>
-    MockingContext<R, arglist...> stub(R(T::*vMethod)(arglist...)) {
-        return this->Mock<C>::template stub<id>(vMethod);
-    }
-
-    template <int id, typename T, typename... arglist>
-    requires std::is_base_of_v<T, C> && std::is_pointer_v<typename select_last<arglist...>::type>
-    ComMockingContext<arglist...> stub(HRESULT(T::*vMethod)(arglist...)) {
-        return this->Mock<C>::template stub<id>(vMethod);
-    }
-};
-
 TEST_CASE("method matching")
 {
     config c;
@@ -419,6 +807,65 @@ TEST_CASE("method matching")
         CHECK(not c.should_instrument(&method.get()));
     }
 
+    SUBCASE("by overlapping classes") {
+        load_config(c, YAML::Load(R"(
+            packages:
+            - class: Extinction
+              exclude:
+              - class: Rebellion
+                exclude: [Protest]
+              - Rebellion.Strike
+            - Extinction.Rebellion.Strike.General
+        )"));
+
+        CHECK(c.should_instrument(&method.get()));
+
+        Method(method, GetFullName) = "Extinction.Rebellion.Die";
+        CHECK(not c.should_instrument(&method.get()));
+
+        Method(method, GetFullName) = "Extinction.Rebellion.Strike.Climate";
+        CHECK(not c.should_instrument(&method.get()));
+
+        Method(method, GetFullName) = "Extinction.Rebellion.Strike.General.Call";
+        CHECK(c.should_instrument(&method.get()));
+
+        Method(method, GetFullName) = "Extinction.Event";
+        CHECK(c.should_instrument(&method.get()));
+    }
+
+    SUBCASE("whole modules") {
+        load_config(c, YAML::Load("packages: [module: xr.dll, {module: xr2.dll, exclude: [Extinction]}]"));
+        CHECK(c.should_instrument(&module.get()) == module_verdict::included);
+
+        Method(module, GetModuleName) = "xr2.dll";
+        CHECK(c.should_instrument(&module.get()) == module_verdict::per_method);
+
+        Method(module, GetModuleName) = "other.dll";
+        CHECK(c.should_instrument(&module.get()) == module_verdict::excluded);
+    }
+
+    SUBCASE("with modules and paths nested in classes") {
+        load_config(c, YAML::Load(R"(
+            packages:
+            - class: Extinction
+              exclude:
+              - module: xr.dll
+                exclude: [Rebellion.Protest]
+              - path: /usr/share
+        )"));
+
+        CHECK(c.should_instrument(&method.get()));
+
+        Method(method, GetFullName) = "Extinction.Rebellion.Strike";
+        CHECK(not c.should_instrument(&method.get()));
+
+        Method(module, GetModuleName) = "other.dll";
+        CHECK(c.should_instrument(&method.get()));
+
+        Method(module, GetFullPath) = "/usr/share/other.dll";
+        CHECK(not c.should_instrument(&method.get()));
+    }
+
     SUBCASE("by path") {
         SUBCASE("absolute") {
             load_config(c, YAML::Load("packages: [path: /src/xr]"));
@@ -1,12 +1,33 @@
 #pragma once
 
+#include <chrono>
 #include <filesystem>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include <clrie/method_info.h>
+#include <clrie/module_info.h>
 
 namespace appmap {
+    enum class capture_policy {
+        none,           // not recorded at all
+        type_only,      // static class name only
+        identity,       // object identity and the static class name
+        primitive_only, // values of primitive types and strings; class name of anything else
+        tostring        // full value, calling ToString() on non-primitives
+    };
+
+    // What can be decided about instrumenting a module as a whole, before any of it is compiled.
+    enum class module_verdict {
+        excluded,   // no filter can match any method in it
+        included,   // all of its methods are instrumented
+        per_method  // methods have to be checked one by one
+    };
+
     struct config {
         std::optional<std::filesystem::path> module_list_path;
         std::optional<std::filesystem::path> appmap_output_path;
@@ -15,8 +36,61 @@ namespace appmap {
 
         bool generate_classmap = false;
 
+        // Hash of the effective configuration, to tell whether anything cached with it is still valid.
+        size_t fingerprint = 0;
+
+        // Captured strings longer than this (in UTF-16 code units) are truncated; 0 means no limit.
+        int32_t max_string_length = 10000;
+
+        // Arrays and collections are captured as their size and at most this many leading
+        // elements (of primitive arrays only).
+        int32_t max_collection_elements = 10;
+
+        // Methods too trivial to be worth recording, which are left alone so that the JIT can
+        // still inline them. Only decided from metadata, so none of them is on by default.
+        struct trivial_methods {
+            uint32_t max_il_size = 0;          // methods with at most this many bytes of IL; 0 for none
+            bool accessors = false;            // compiler-generated property getters and setters
+            bool aggressive_inlining = false;  // methods marked MethodImplOptions.AggressiveInlining
+
+            bool any() const noexcept { return max_il_size || accessors || aggressive_inlining; }
+        } skip_trivial;
+
+        // Full names of attributes excluding the types and methods they're applied to,
+        // and types nested in them, such as compiler-generated closures and state machines.
+        // In UTF-16, as they're only ever looked up in metadata.
+        std::vector<std::u16string> exclude_attributes;
+
+        // Calls nested deeper than max_depth recorded calls, or in more than max_recursion
+        // recorded calls of the same method directly, aren't recorded, only counted; 0 for no limit.
+        uint32_t max_depth = 0;
+        uint32_t max_recursion = 0;
+
+        // Consecutive calls on a thread with the same call tree, beyond the first max_repeats,
+        // are left out of the appmap and only summed up; 0 keeps them all.
+        uint32_t max_repeats = 0;
+
+        // Calls returning faster than this, with nothing slower in them, aren't recorded;
+        // given in microseconds in appmap.yml. 0 records all calls.
+        std::chrono::steady_clock::duration min_duration{};
+
         static config &instance();
-        bool should_instrument(clrie::method_info method);
+        bool should_instrument(clrie::method_info method) const;
+        // method_name is the full name of a method in the module
+        bool should_instrument(clrie::module_info module, std::string_view method_name) const;
+        module_verdict should_instrument(clrie::module_info module) const;
+
+        // Value capture rules; a parameter type rule takes precedence over a class rule,
+        // which takes precedence over the most specific package rule.
+        std::unordered_map<std::string, capture_policy> type_capture;
+        std::unordered_map<std::string, capture_policy> class_capture;
+        std::vector<std::pair<std::string, capture_policy>> package_capture;
+        capture_policy default_capture = capture_policy::tostring;
+
+        // Policy for parameters and return values of type type_name in methods of class_name.
+        capture_policy value_capture(const std::string &class_name, const std::string &type_name) const noexcept;
+        // Receivers are never stringified unless their class has an explicit type rule.
+        capture_policy receiver_capture(const std::string &class_name) const noexcept;
 
         std::unique_ptr<std::ostream> module_list_stream() const;
         std::unique_ptr<std::ostream> appmap_output_stream() const;
@@ -27,6 +101,9 @@ namespace appmap {
         using filter_list = std::vector<std::unique_ptr<instrumentation_filter>>;
         filter_list filters;
 
+        struct filter_set;
+        std::shared_ptr<const filter_set> compiled_filters;
+
     private:
         mutable std::optional<std::filesystem::path> output_dir;
     };
@@ -1,17 +1,43 @@
 #pragma once
+#include <chrono>
 #include <optional>
 #include <string>
 #include <type_traits>
 #include <typeinfo>
 #include <variant>
+#include <vector>
 
 #include <nlohmann/json_fwd.hpp>
 
+#include "intern.h"
+
 namespace appmap {
-    using cor_value = std::variant<std::string, uint64_t, int64_t, bool, nullptr_t>;
+    // Stable identity of a captured object, as given by RuntimeHelpers.GetHashCode().
+    struct object_id {
+        int32_t id;
+        bool operator==(const object_id &) const = default;
+    };
+
+    // Leading part of a string which was too long to be captured in full.
+    struct truncated_string {
+        std::u16string value;
+        int32_t length;  // of the original string
+        bool operator==(const truncated_string &) const = default;
+    };
+
+    // Size of an array or collection, with a copy of its leading elements if they're primitive.
+    struct collection {
+        int32_t size;
+        std::vector<std::variant<int64_t, uint64_t, bool>> elements{};
+        bool operator==(const collection &) const = default;
+    };
+
+    // Strings are kept in UTF-16 as captured, and only transcoded when generating the appmap.
+    using cor_value = std::variant<std::u16string, uint64_t, int64_t, bool, nullptr_t, object_id, truncated_string, collection>;
 
     struct event {
         uint64_t thread;
+        std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now();
         explicit event(uint64_t thread_id): thread(thread_id) {}
 
         virtual bool operator==(const event &other) const noexcept {
@@ -27,6 +53,7 @@ namespace appmap {
     struct function_call_event: call_event {
         size_t function;
         std::vector<cor_value> arguments;
+        size_t skipped_calls = 0;  // calls made from this one which weren't recorded, beyond the depth limits
 
         function_call_event(uint64_t thread_id, size_t fun, std::vector<cor_value> &&args = {}):
             call_event(thread_id),
@@ -56,6 +83,8 @@ namespace appmap {
     struct return_event: event {
         const call_event *call;
         std::optional<cor_value> value = std::nullopt;
+        bool threw = false;  // returned by an exception rather than normally
+        interned_string exception_class;  // of the exception, if known
 
         return_event(uint64_t thread_id, const call_event *call_ev,
                 std::optional<cor_value> return_value = std::nullopt):
@@ -67,7 +96,8 @@ namespace appmap {
                 return false;
 
             const auto &other_ret = static_cast<const return_event &>(other);
-            return call == other_ret.call && value == other_ret.value;
+            return call == other_ret.call && value == other_ret.value && threw == other_ret.threw
+                && exception_class == other_ret.exception_class;
         }
 
         operator nlohmann::json() const override;
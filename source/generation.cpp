@@ -1,15 +1,19 @@
 #include <doctest/doctest.h>
+#include <gsl/gsl-lite.hpp>
 #include <nlohmann/json.hpp>
 #include <spdlog/spdlog.h>
 #include <spdlog/fmt/bundled/ranges.h>
 
 #include <algorithm>
+#include <map>
 #include <unordered_set>
 #include <sstream>
 
 #include "classmap.h"
+#include "config.h"
 #include "generation.h"
 #include "method_info.h"
+#include "utf16.h"
 
 using namespace appmap;
 using namespace nlohmann;
@@ -40,7 +44,7 @@ namespace {
             const auto &method = method_infos.at(fun);
             classmap::code_container *code = &map;
 
-            std::istringstream tokens(method.defined_class);
+            std::istringstream tokens(method.defined_class.str());
             std::string part;
             while (std::getline(tokens, part, '.')) {
                 auto [it, inserted] = code->try_emplace(part, std::make_unique<classmap::code_object>(classmap::code_container()));
@@ -50,26 +54,193 @@ namespace {
             }
 
             code->kind = classmap::code_container::klass;
-            code->try_emplace(method.method_id, std::make_unique<classmap::code_object>(classmap::function{method.is_static}));
+            code->try_emplace(method.method_id.str(), std::make_unique<classmap::code_object>(classmap::function{method.is_static}));
         }
 
         return map;
     }
 
     constexpr char APPMAP_VERSION[] = "1.6.0";
+
+    // Finds runs of consecutive calls on a thread with the same call tree -- calls of the
+    // same method, which called the same methods in the same order and structure, and
+    // ended the same way -- and leaves out the calls of each run beyond the first max_repeats.
+    // The last call kept gets the number and total elapsed time of the ones left out.
+    class repeat_compression {
+        struct summary {
+            size_t count = 0;
+            std::chrono::steady_clock::duration elapsed{};
+        };
+
+        struct frame {
+            const call_event *call;
+            std::vector<size_t> key{};  // method, shapes of the calls made, whether it threw and what
+            // the current run of calls made from this one
+            size_t run_shape = 0;
+            size_t run_length = 0;
+            const return_event *run_kept = nullptr;
+        };
+
+        const size_t max_repeats;
+        // Call trees are interned as shapes, so that comparing them doesn't need to walk them.
+        std::map<std::vector<size_t>, size_t> shapes;
+        size_t next_shape = 0;
+        std::unordered_map<uint64_t, std::vector<frame>> stacks;  // by thread; the first frame stands for the thread itself
+
+        std::unordered_set<const call_event *> omitted_repeats;  // calls left out of the runs...
+        std::unordered_set<const call_event *> omitted;  // ...and the ones they made, so far
+        std::unordered_map<uint64_t, const call_event *> omitting;  // by thread
+        std::unordered_map<const return_event *, summary> summaries;  // by the return of the last call kept
+
+        std::vector<frame> &stack(uint64_t thread)
+        {
+            auto &s = stacks[thread];
+            if (s.empty())
+                s.push_back({nullptr});
+            return s;
+        }
+
+        // Calls which didn't return on their thread, and anything but method calls, are one of a kind.
+        void close(std::vector<frame> &stack, const return_event *ret)
+        {
+            auto f = std::move(stack.back());
+            stack.pop_back();
+
+            size_t shape;
+            if (ret && !f.key.empty()) {
+                f.key.push_back(ret->threw);
+                f.key.push_back(ret->exception_class.id());
+                shape = shapes.try_emplace(std::move(f.key), next_shape).first->second;
+                if (shape == next_shape)
+                    next_shape++;
+            } else {
+                shape = next_shape++;
+            }
+
+            auto &parent = stack.back();
+            parent.key.push_back(shape);
+            if (ret && parent.run_kept && parent.run_shape == shape) {
+                if (++parent.run_length > max_repeats) {
+                    omitted_repeats.insert(f.call);
+                    auto &sum = summaries[parent.run_kept];
+                    sum.count++;
+                    sum.elapsed += ret->time - f.call->time;
+                } else {
+                    parent.run_kept = ret;
+                }
+            } else {
+                parent.run_shape = shape;
+                parent.run_length = 1;
+                parent.run_kept = ret;
+            }
+        }
+
+    public:
+        repeat_compression(const recording &events, size_t max_repeats): max_repeats(max_repeats)
+        {
+            if (!max_repeats)
+                return;
+
+            for (const auto &ev: events) {
+                if (const auto call = dynamic_cast<const call_event *>(ev.get())) {
+                    auto &f = stack(call->thread).emplace_back(frame{call});
+                    if (const auto fun = dynamic_cast<const function_call_event *>(call))
+                        f.key.push_back(fun->function);
+                } else if (const auto ret = dynamic_cast<const return_event *>(ev.get())) {
+                    auto &s = stack(ret->thread);
+                    const auto it = std::find_if(s.begin() + 1, s.end(), [ret](const frame &f) { return f.call == ret->call; });
+                    if (it == s.end())
+                        continue;
+                    // calls left open in the meantime never returned
+                    while (s.back().call != ret->call)
+                        close(s, nullptr);
+                    close(s, ret);
+                }
+            }
+            stacks.clear();
+        }
+
+        // Whether to leave the event out; must see all the events, in order.
+        bool omits(const event &ev)
+        {
+            if (omitted_repeats.empty())
+                return false;
+
+            if (const auto call = dynamic_cast<const call_event *>(&ev)) {
+                auto &root = omitting[call->thread];
+                if (!root && omitted_repeats.count(call))
+                    root = call;
+                if (root)
+                    omitted.insert(call);
+                return root != nullptr;
+            }
+
+            if (const auto ret = dynamic_cast<const return_event *>(&ev); ret && omitted.count(ret->call)) {
+                if (auto it = omitting.find(ret->call->thread); it != omitting.end() && it->second == ret->call)
+                    it->second = nullptr;
+                return true;
+            }
+            return false;
+        }
+
+        void summarize(json &j, const return_event &ret) const
+        {
+            if (const auto it = summaries.find(&ret); it != summaries.end())
+                j["omitted_repeats"] = {
+                    { "count", it->second.count },
+                    { "elapsed", std::chrono::duration<double>(it->second.elapsed).count() }
+                };
+        }
+    };
 }
 
 
 namespace appmap {
     void to_json(json &j, const method_info &m) {
-        j["defined_class"] = m.defined_class;
-        j["method_id"] = m.method_id;
+        j["defined_class"] = m.defined_class.str();
+        j["method_id"] = m.method_id.str();
         j["static"] = m.is_static;
     }
 
     void to_json(json &j, const parameter_info &p) {
-        j["name"] = p.name;
-        j["class"] = p.type;
+        j["name"] = p.name.str();
+        j["class"] = p.type.str();
+    }
+
+    // Renders captured elements like [1, 2, ...], with an ellipsis for the ones not captured.
+    std::string collection_string(const collection &c) {
+        std::ostringstream out;
+        out << std::boolalpha << '[';
+        for (size_t i = 0; i < c.elements.size(); i++) {
+            if (i) out << ", ";
+            std::visit([&out] (auto e) { out << e; }, c.elements[i]);
+        }
+        if (c.elements.size() < static_cast<size_t>(c.size))
+            out << (c.elements.empty() ? "..." : ", ...");
+        out << ']';
+        return out.str();
+    }
+
+    // Identities are written as object_id, with the class name standing in for the value.
+    // Truncated strings carry the length of the original, collections their size.
+    void put_value(json &j, const cor_value &value) {
+        std::visit([&j] (auto &&v) {
+            using t = std::decay_t<decltype(v)>;
+            if constexpr (std::is_same_v<t, object_id>) {
+                j["object_id"] = v.id;
+                j["value"] = j["class"];
+            } else if constexpr (std::is_same_v<t, truncated_string>) {
+                j["value"] = utf16::to_utf8(v.value);
+                j["original_length"] = v.length;
+            } else if constexpr (std::is_same_v<t, collection>) {
+                j["value"] = collection_string(v);
+                j["size"] = v.size;
+            } else if constexpr (std::is_same_v<t, std::u16string>) {
+                j["value"] = utf16::to_utf8(v);
+            } else {
+                j["value"] = v;
+            }
+        }, value);
     }
 
     event::operator json() const
@@ -85,12 +256,15 @@ namespace appmap {
         j["event"] = "call";
 
         bool capture_receiver = !method.is_static;
-        auto param_it = method.parameters.begin();
-        const auto &args = arguments;
+        auto arg_it = arguments.begin();
         json params = json::array();
-        for (const auto &arg: args) {
-            json param = *(param_it++);
-            std::visit([&param] (auto &&v) { param["value"] = v; }, arg);
+        for (const auto &info: method.parameters) {
+            json param = info;
+            if (info.captured) {
+                if (arg_it == arguments.end())
+                    break;
+                put_value(param, *(arg_it++));
+            }
             if (capture_receiver) {
                 param.erase("name");
                 j["receiver"] = param;
@@ -104,6 +278,9 @@ namespace appmap {
             j["parameters"] = params;
         }
 
+        if (skipped_calls)
+            j["skipped_calls"] = skipped_calls;
+
         return j;
     }
 
@@ -112,12 +289,19 @@ namespace appmap {
         auto j = event::operator json();
 
         j["event"] = "return";
+        const auto call_fun = dynamic_cast<const function_call_event *>(call);
         if (value) {
             auto &rv = j["return_value"] = {};
-            if (const auto call_fun = dynamic_cast<const function_call_event *>(call)) {
-                rv["class"] = method_infos.at(call_fun->function).return_type;
+            if (call_fun) {
+                rv["class"] = method_infos.at(call_fun->function).return_type.str();
             }
-            std::visit([&rv] (auto &&arg) { rv["value"] = arg; }, *value);
+            put_value(rv, *value);
+        } else if (threw) {
+            // the exception itself isn't captured, only its class, when that's known
+            if (!exception_class.str().empty())
+                j["exceptions"] = json::array({{{ "class", exception_class.str() }}});
+        } else if (call_fun && method_infos.at(call_fun->function).return_type_only) {
+            j["return_value"] = {{ "class", method_infos.at(call_fun->function).return_type.str() }};
         }
 
         return j;
@@ -145,6 +329,7 @@ namespace appmap {
 
     struct generation_visitor {
         json &events;
+        const repeat_compression &repeats;
         using id_t = uint;
 
         id_t id = 1;
@@ -159,6 +344,7 @@ namespace appmap {
         void operator()(const return_event &ev) {
             json jev(ev);
             jev["parent_id"] = calls.at(ev.call);
+            repeats.summarize(jev, ev);
             calls.erase(ev.call);
             push(std::move(jev));
         }
@@ -182,9 +368,11 @@ namespace appmap {
 
     void to_json(json &j, const appmap::recording &events)
     {
-        generation_visitor v{j};
+        repeat_compression repeats(events, config::instance().max_repeats);
+        generation_visitor v{j, repeats};
         for (const auto &ev : events) {
-            v(*ev);
+            if (!repeats.omits(*ev))
+                v(*ev);
         }
     }
 
@@ -343,3 +531,132 @@ TEST_CASE("http events generation") {
             }
     ]})"_json);
 }
+
+TEST_CASE("receiver generation") {
+    appmap::recording events;
+
+    const auto fun = method_infos.push_back({ "Some.Class", "Method", false, "Void", {
+        { "Some.Class", "this" },
+        { "Some.Struct", "s", false },
+        { "I8", "i" }
+    }});
+
+    events.push_back(std::make_unique<function_call_event>(42, fun, std::vector<cor_value>{ object_id{1234}, int64_t{5} }));
+    CHECK(json(*events.back()) == R"({
+        "event": "call",
+        "defined_class": "Some.Class",
+        "method_id": "Method",
+        "static": false,
+        "thread_id": 42,
+        "receiver": {
+            "class": "Some.Class",
+            "object_id": 1234,
+            "value": "Some.Class"
+        },
+        "parameters": [
+            { "class": "Some.Struct", "name": "s" },
+            { "class": "I8", "name": "i", "value": 5 }
+        ]
+    })"_json);
+}
+
+TEST_CASE("return value generation") {
+    appmap::recording events;
+
+    const auto fun = method_infos.push_back({ "Some.Class", "Text", true, "System.String" });
+    method_infos.push_back({ "Some.Class", "Thing", true, "Some.Thing", {}, true });
+    method_infos.push_back({ "Some.Class", "Numbers", true, "I4[]" });
+
+    events.push_back(std::make_unique<function_call_event>(42, fun));
+    events.push_back(std::make_unique<function_call_event>(42, fun + 1));
+    events.push_back(std::make_unique<function_call_event>(42, fun + 2));
+
+    SUBCASE("truncated") {
+        return_event ret{42, static_cast<function_call_event *>(events[0].get()), truncated_string{u"abc", 12345}};
+        CHECK(json(ret)["return_value"] == R"({
+            "class": "System.String",
+            "value": "abc",
+            "original_length": 12345
+        })"_json);
+    }
+
+    SUBCASE("type only") {
+        return_event ret{42, static_cast<function_call_event *>(events[1].get())};
+        CHECK(json(ret)["return_value"] == R"({ "class": "Some.Thing" })"_json);
+    }
+
+    SUBCASE("collection") {
+        const auto call = static_cast<function_call_event *>(events[2].get());
+
+        return_event ret{42, call, collection{12, {int64_t{1}, int64_t{-2}}}};
+        CHECK(json(ret)["return_value"] == R"({ "class": "I4[]", "value": "[1, -2, ...]", "size": 12 })"_json);
+
+        return_event all{42, call, collection{2, {int64_t{1}, int64_t{-2}}}};
+        CHECK(json(all)["return_value"]["value"] == "[1, -2]");
+
+        return_event none{42, call, collection{3}};
+        CHECK(json(none)["return_value"]["value"] == "[...]");
+    }
+
+    SUBCASE("exception") {
+        return_event ret{42, static_cast<function_call_event *>(events[1].get())};
+        ret.threw = true;
+        CHECK(!json(ret).contains("return_value"));
+        CHECK(!json(ret).contains("exceptions"));
+
+        ret.exception_class = "System.InvalidOperationException";
+        CHECK(json(ret)["exceptions"] == R"([{ "class": "System.InvalidOperationException" }])"_json);
+    }
+}
+
+TEST_CASE("repeated calls") {
+    auto &config = config::instance();
+    const auto restore = gsl::finally([&config]() { config.max_repeats = 0; });
+    config.max_repeats = 2;
+
+    const auto loop = method_infos.push_back({ "Some.Class", "Loop", true, "System.Void" });
+    const auto body = method_infos.push_back({ "Some.Class", "Body", true, "System.Void" });
+    const auto leaf = method_infos.push_back({ "Some.Class", "Leaf", true, "System.Void" });
+
+    appmap::recording events;
+    const auto call = [&events](uint64_t thread, size_t fun) {
+        events.push_back(std::make_unique<function_call_event>(thread, fun));
+        return static_cast<const call_event *>(events.back().get());
+    };
+    const auto ret = [&events](uint64_t thread, const call_event *c) {
+        events.push_back(std::make_unique<return_event>(thread, c));
+        return events.back().get();
+    };
+
+    const auto start = std::chrono::steady_clock::time_point{};
+    const auto outer = call(42, loop);
+    for (int i = 0; i < 6; i++) {
+        const auto b = call(42, body);
+        const_cast<call_event *>(b)->time = start + std::chrono::milliseconds(10 * i);
+        if (i < 5)
+            ret(42, call(42, leaf));
+        if (i == 3)
+            ret(7, call(7, leaf));  // doesn't break the run on the other thread
+        ret(42, b)->time = start + std::chrono::milliseconds(10 * i + 2);
+    }
+    ret(42, outer);
+
+    const auto generated = json::parse(generate(events, false))["events"];
+    std::vector<std::string> methods;
+    for (const auto &ev: generated)
+        methods.push_back(ev.value("method_id", ev["event"].get<std::string>()));
+    CHECK(methods == std::vector<std::string>{
+        "Loop", "Body", "Leaf", "return", "return", "Body", "Leaf", "return", "return",
+        "Leaf", "return",
+        "Body", "return", "return"
+    });
+
+    const auto &summary = generated[8]["omitted_repeats"];
+    CHECK(summary["count"] == 3);
+    CHECK(summary["elapsed"] == 0.006);
+    CHECK(generated[8]["parent_id"] == 6);
+    CHECK(!generated[4].contains("omitted_repeats"));
+
+    config.max_repeats = 0;
+    CHECK(json::parse(generate(events, false))["events"].size() == events.size());
+}
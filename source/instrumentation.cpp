@@ -2,20 +2,150 @@
 #include <spdlog/fmt/bundled/ranges.h>
 #include <utf8.h>
 
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#include "concurrent.h"
 #include "method.h"
 #include "instrumentation.h"
 
 using namespace appmap;
 
-com::ptr<ISignatureBuilder> appmap::instrumentation::signature_builder = nullptr;
+com::ptr<IProfilerManager> appmap::instrumentation::profiler_manager = nullptr;
+
+namespace appmap {
+    struct module_context {
+        using signature = std::vector<COR_SIGNATURE>;
+
+        module_context(clrie::module_info module, ModuleID id): module(std::move(module)), id(id) {}
+
+        const clrie::module_info module;
+        const ModuleID id;
+
+        std::map<std::u16string, mdAssemblyRef> referenced_assemblies;
+        std::map<std::u16string, mdAssemblyRef> assemblies;
+        std::map<std::pair<mdToken, std::u16string>, mdTypeRef> types;
+        std::map<std::tuple<mdToken, std::u16string, signature>, mdMemberRef> members;
+        std::map<signature, mdSignature> signatures;
+        std::map<signature, mdTypeSpec> type_specs;
+
+        // Finds the token in the map, or emits it into metadata first.
+        // Emitting is serialized per module too, as the metadata API isn't safe to call concurrently.
+        template <typename Map, typename Emit>
+        mdToken get(Map &map, typename Map::key_type key, Emit emit)
+        {
+            std::lock_guard lock(mutex);
+            if (const auto it = map.find(key); it != map.end())
+                return it->second;
+            const mdToken token = emit();
+            map.emplace(std::move(key), token);
+            return token;
+        }
+
+        // Emits a definition, which isn't cached, serialized like get().
+        template <typename Emit>
+        mdToken define(Emit emit)
+        {
+            std::lock_guard lock(mutex);
+            return emit();
+        }
+
+        const com::ptr<IMetaDataEmit> &metadata()
+        {
+            std::call_once(metadata_once, [this]() { metadata_ = module.meta_data_emit(); });
+            return metadata_;
+        }
+
+        const com::ptr<ITypeCreator> &type_factory()
+        {
+            std::call_once(type_factory_once, [this]() { type_factory_ = module.create_type_factory(); });
+            return type_factory_;
+        }
+
+    private:
+        std::mutex mutex;
+        std::once_flag metadata_once, type_factory_once;
+        com::ptr<IMetaDataEmit> metadata_;
+        com::ptr<ITypeCreator> type_factory_;
+    };
+}
+
+namespace {
+    struct module_id_hash {
+        uint64_t operator()(ModuleID module) const noexcept { return hash_mix(module); }
+    };
+
+    struct context_registry {
+        concurrent_map<ModuleID, std::shared_ptr<module_context>, module_id_hash> by_module;
+        std::mutex mutex;  // serializes adding modules
+    };
+
+    context_registry &registry()
+    {
+        static context_registry registry;
+        return registry;
+    }
+}
+
+module_context &appmap::instrumentation::context() const
+{
+    if (context_)
+        return *context_;
+
+    auto module = method.module_info();
+    const auto id = module.module_id();
+
+    auto &r = registry();
+    if (const auto context = r.by_module.find(id); context && *context)
+        return *(context_ = *context);
+
+    std::lock_guard lock(r.mutex);
+    if (const auto context = r.by_module.find(id); context && *context)
+        return *(context_ = *context);
+    return *(context_ = r.by_module.insert_or_assign(id, std::make_shared<module_context>(std::move(module), id)));
+}
+
+void appmap::instrumentation::forget_module(ModuleID module)
+{
+    auto &r = registry();
+    std::lock_guard lock(r.mutex);
+    if (r.by_module.find(module))
+        r.by_module.insert_or_assign(module, nullptr);
+}
+
+const clrie::module_info &appmap::instrumentation::module() const
+{
+    return context().module;
+}
+
+ModuleID appmap::instrumentation::module_id() const
+{
+    return context().id;
+}
+
+const com::ptr<IMetaDataEmit> &appmap::instrumentation::metadata() const
+{
+    return context().metadata();
+}
+
+const com::ptr<ITypeCreator> &appmap::instrumentation::type_factory() const
+{
+    return context().type_factory();
+}
+
+const com::ptr<ILocalVariableCollection> &appmap::instrumentation::locals() const
+{
+    if (!locals_)
+        locals_ = method.get(&IMethodInfo::GetLocalVariables);
+    return locals_;
+}
 
 appmap::instrumentation::instruction_sequence appmap::instrumentation::make_call_sig(void *fn, gsl::span<const COR_SIGNATURE> signature) const
 {
-    mdToken token;
-    com::hresult::check(metadata->GetTokenFromSig(signature.data(), signature.size(), &token));
     return {
         create_long_operand_instruction(Cee_Ldc_I8, reinterpret_cast<int64_t>(fn)),
-        create_token_operand_instruction(Cee_Calli, token)
+        create_token_operand_instruction(Cee_Calli, signature_token(signature))
     };
 }
 
@@ -55,7 +185,10 @@ namespace {
 
     std::vector<COR_SIGNATURE> signature_of_type(const clrie::type &type)
     {
-        auto &builder = instrumentation::signature_builder;
+        // a builder isn't safe to share between threads
+        thread_local com::ptr<ISignatureBuilder> builder;
+        if (!builder)
+            builder = instrumentation::profiler_manager.get(&IProfilerManager::CreateSignatureBuilder);
         com::hresult::check(builder->Clear());
         type.add_to_signature(builder);
         const COR_SIGNATURE *signature = builder.get(&ISignatureBuilder::GetCorSignaturePtr);
@@ -73,6 +206,63 @@ namespace {
         return false;
     }
 
+    // The signature of the type argument of a generic instantiation with a single one.
+    std::optional<std::vector<COR_SIGNATURE>> single_type_argument(const std::vector<COR_SIGNATURE> &signature)
+    {
+        if (signature.size() < 4 || signature[0] != ELEMENT_TYPE_GENERICINST)
+            return std::nullopt;
+        PCCOR_SIGNATURE p = &signature[2];
+        CorSigUncompressToken(p);
+        if (CorSigUncompressData(p) != 1)
+            return std::nullopt;
+        return std::vector<COR_SIGNATURE>(p, signature.data() + signature.size());
+    }
+
+    // Whether the type is sealed and can't be a collection: neither it nor its base types
+    // implement an interface of System.Collections. Types whose interfaces or base types
+    // can't be told from the module's metadata (other than System.Object) might be one.
+    bool is_sealed_non_collection(const com::ptr<IMetaDataImport> &md, mdTypeDef type)
+    {
+        const auto name_of = [&md](mdToken token) {
+            char16_t name[256] = {};
+            if (TypeFromToken(token) == mdtTypeSpec) {
+                PCCOR_SIGNATURE spec;
+                ULONG length;
+                if (md->GetTypeSpecFromToken(token, &spec, &length) != S_OK || length < 3 || spec[0] != ELEMENT_TYPE_GENERICINST)
+                    return std::u16string();
+                spec += 2;
+                token = CorSigUncompressToken(spec);
+            }
+            if (TypeFromToken(token) != mdtTypeRef || md->GetTypeRefProps(token, nullptr, name, 256, nullptr) != S_OK)
+                return std::u16string();
+            return std::u16string(name);
+        };
+
+        DWORD flags;
+        if (md->GetTypeDefProps(type, nullptr, 0, nullptr, &flags, nullptr) != S_OK || !IsTdSealed(flags))
+            return false;
+
+        for (mdToken t = type; TypeFromToken(t) == mdtTypeDef;) {
+            HCORENUM it = nullptr;
+            scope_guard closer{ [&]() { if (it) md->CloseEnum(it); } };
+            mdInterfaceImpl impl;
+            while (md->EnumInterfaceImpls(&it, t, &impl, 1, nullptr) == S_OK) {
+                mdToken iface;
+                if (md->GetInterfaceImplProps(impl, nullptr, &iface) != S_OK)
+                    return false;
+                const auto name = name_of(iface);
+                if (name.empty() || name.starts_with(u"System.Collections."))
+                    return false;
+            }
+
+            if (md->GetTypeDefProps(t, nullptr, 0, nullptr, nullptr, &t) != S_OK)
+                return false;
+            if (TypeFromToken(t) != mdtTypeDef)
+                return name_of(t) == u"System.Object";
+        }
+        return false;
+    }
+
     constexpr ILOrdinalOpcode dereference_instruction(CorElementType type) {
         switch (type) {
             case ELEMENT_TYPE_I1: return Cee_Ldind_I1;
@@ -111,8 +301,6 @@ namespace {
 
 clrie::instruction_factory::instruction_sequence appmap::instrumentation::create_call_to_string(const clrie::type &type) const noexcept
 {
-    static std::unordered_map<ModuleID, mdMemberRef> object_to_string_refs;
-
     mdTypeSpec type_token;
 
     const auto signature = signature_of_type(type);
@@ -122,16 +310,12 @@ clrie::instruction_factory::instruction_sequence appmap::instrumentation::create
     try {
         type_token = type.as<ITokenType>().get(&ITokenType::GetToken);
     } catch (const std::system_error &) {
-        type_token = metadata.get(&IMetaDataEmit::GetTokenFromTypeSpec, signature.data(), signature.size());
+        type_token = this->type_token(signature);
     }
 
-    if (object_to_string_refs.find(module_id) == object_to_string_refs.end()) {
-        auto system_runtime = find_assembly_ref(module.meta_data_assembly_import(), u"System.Runtime");
-        auto import = module.meta_data_import();
-        auto system_object = metadata.get(&IMetaDataEmit::DefineTypeRefByName, system_runtime, u"System.Object");
-        constexpr COR_SIGNATURE to_string_sig[] = { IMAGE_CEE_CS_CALLCONV_DEFAULT_HASTHIS, 0, ELEMENT_TYPE_STRING };
-        object_to_string_refs[module_id] = metadata.get(&IMetaDataEmit::DefineMemberRef, system_object, u"ToString", to_string_sig, sizeof(to_string_sig));
-    }
+    constexpr COR_SIGNATURE to_string_sig[] = { IMAGE_CEE_CS_CALLCONV_DEFAULT_HASTHIS, 0, ELEMENT_TYPE_STRING };
+    const auto object_to_string = member_reference(
+        type_reference(referenced_assembly(u"System.Runtime"), u"System.Object"), u"ToString", to_string_sig);
 
     instruction_sequence result;
 
@@ -157,7 +341,7 @@ clrie::instruction_factory::instruction_sequence appmap::instrumentation::create
             create_branch_instruction(Cee_Brfalse, end),
         };
     } else {
-        auto local = locals.get(&ILocalVariableCollection::AddLocal, type);
+        auto local = locals().get(&ILocalVariableCollection::AddLocal, type);
         result += {
             create_store_local_instruction(local),
             create_load_local_address_instruction(local),
@@ -165,7 +349,7 @@ clrie::instruction_factory::instruction_sequence appmap::instrumentation::create
         };
     }
 
-    result += create_token_operand_instruction(Cee_Callvirt, object_to_string_refs[module_id]);
+    result += create_token_operand_instruction(Cee_Callvirt, object_to_string);
 
     if (is_obj)
         result += end;
@@ -173,6 +357,236 @@ clrie::instruction_factory::instruction_sequence appmap::instrumentation::create
     return result;
 }
 
+clrie::instruction_factory::instruction_sequence appmap::instrumentation::create_call_to_get_hash_code() const
+{
+    return cil::compile({ call_get_hash_code() }, *this);
+}
+
+cil::instruction appmap::instrumentation::call_get_hash_code() const
+{
+    constexpr COR_SIGNATURE get_hash_code_sig[] = { IMAGE_CEE_CS_CALLCONV_DEFAULT, 1, ELEMENT_TYPE_I4, ELEMENT_TYPE_OBJECT };
+    const auto runtime_helpers = type_reference(referenced_assembly(u"System.Runtime"), u"System.Runtime.CompilerServices.RuntimeHelpers");
+    return cil::ops::call{member_reference(runtime_helpers, u"GetHashCode", get_hash_code_sig)};
+}
+
+clrie::instruction_factory::instruction_sequence appmap::instrumentation::create_call_to_get_type_name() const
+{
+    const auto type = type_reference(referenced_assembly(u"System.Runtime"), u"System.Type");
+    return {
+        create_token_operand_instruction(Cee_Callvirt, member_reference(object_type(), u"GetType", signature::method(type, {}))),
+        create_token_operand_instruction(Cee_Callvirt, member_reference(type, u"get_FullName", signature::method(signature::string, {})))
+    };
+}
+
+mdTypeRef appmap::instrumentation::object_type() const
+{
+    return type_reference(referenced_assembly(u"System.Runtime"), u"System.Object");
+}
+
+cil::instruction appmap::instrumentation::call_task_status() const
+{
+    const auto system_runtime = referenced_assembly(u"System.Runtime");
+    const auto get_status_sig = signature::method(
+        signature::value{type_reference(system_runtime, u"System.Threading.Tasks.TaskStatus")}, {});
+    return cil::ops::call{member_reference(type_reference(system_runtime, u"System.Threading.Tasks.Task"), u"get_Status", get_status_sig)};
+}
+
+cil::instruction appmap::instrumentation::call_task_id() const
+{
+    constexpr COR_SIGNATURE get_id_sig[] = { IMAGE_CEE_CS_CALLCONV_HASTHIS, 0, ELEMENT_TYPE_I4 };
+    const auto task = type_reference(referenced_assembly(u"System.Runtime"), u"System.Threading.Tasks.Task");
+    return cil::ops::call{member_reference(task, u"get_Id", get_id_sig)};
+}
+
+clrie::instruction_factory::instruction_sequence appmap::instrumentation::pin_string() const
+{
+    const auto system_runtime = referenced_assembly(u"System.Runtime");
+    constexpr COR_SIGNATURE get_length_sig[] = { IMAGE_CEE_CS_CALLCONV_DEFAULT_HASTHIS, 0, ELEMENT_TYPE_I4 };
+    constexpr COR_SIGNATURE offset_sig[] = { IMAGE_CEE_CS_CALLCONV_DEFAULT, 0, ELEMENT_TYPE_I4 };
+    const auto get_length = member_reference(
+        type_reference(system_runtime, u"System.String"), u"get_Length", get_length_sig);
+    const auto offset_to_string_data = member_reference(
+        type_reference(system_runtime, u"System.Runtime.CompilerServices.RuntimeHelpers"), u"get_OffsetToStringData", offset_sig);
+
+    if (!pinned_string_local) {
+        constexpr COR_SIGNATURE pinned_string[] = { ELEMENT_TYPE_PINNED, ELEMENT_TYPE_STRING };
+        com::ptr<IType> type;
+        com::hresult::check(type_factory()->FromSignature(sizeof(pinned_string), pinned_string, &type, nullptr));
+        pinned_string_local = locals().get(&ILocalVariableCollection::AddLocal, type);
+    }
+    const auto pinned = *pinned_string_local;
+
+    // this is what C# compiles fixed (char *p = str) into
+    auto null_string = create_instruction(Cee_Conv_U8);
+    auto done = create_instruction(Cee_Nop);
+
+    return {
+        create_store_local_instruction(pinned),
+        create_load_local_instruction(pinned),
+        create_instruction(Cee_Conv_U),
+        create_instruction(Cee_Dup),
+        create_branch_instruction(Cee_Brfalse, null_string),
+
+        create_token_operand_instruction(Cee_Call, offset_to_string_data),
+        create_instruction(Cee_Add),
+        create_instruction(Cee_Conv_U8),
+        create_load_local_instruction(pinned),
+        create_token_operand_instruction(Cee_Callvirt, get_length),
+        create_branch_instruction(Cee_Br, done),
+
+        null_string,
+        create_load_const_instruction(0),
+
+        done
+    };
+}
+
+clrie::instruction_factory::instruction_sequence appmap::instrumentation::unpin_string() const
+{
+    assert(pinned_string_local && "unpin_string() without pin_string()");
+    return {
+        create_instruction(Cee_Ldnull),
+        create_store_local_instruction(*pinned_string_local)
+    };
+}
+
+clrie::instruction_factory::instruction_sequence appmap::instrumentation::pin_array(const clrie::type &element_type) const
+{
+    const auto element_signature = signature_of_type(element_type);
+    const auto element_token = type_token(element_signature);
+
+    const auto element = element_type.cor_element_type();
+    if (pinned_element_locals.find(element) == pinned_element_locals.end()) {
+        std::vector<COR_SIGNATURE> pinned_ref = { ELEMENT_TYPE_PINNED, ELEMENT_TYPE_BYREF };
+        pinned_ref.insert(pinned_ref.end(), element_signature.begin(), element_signature.end());
+        com::ptr<IType> type;
+        com::hresult::check(type_factory()->FromSignature(pinned_ref.size(), pinned_ref.data(), &type, nullptr));
+        pinned_element_locals[element] = locals().get(&ILocalVariableCollection::AddLocal, type);
+    }
+    const auto pinned = pinned_element_locals[element];
+
+    // this is what C# compiles fixed (T *p = array) into, except the length is kept
+    auto null_array = create_instruction(Cee_Pop);
+    auto empty = create_instruction(Cee_Ldlen);
+    auto no_data = create_long_operand_instruction(Cee_Ldc_I8, 0);
+    auto done = create_instruction(Cee_Nop);
+
+    return {
+        create_instruction(Cee_Dup),
+        create_branch_instruction(Cee_Brfalse, null_array),
+        create_instruction(Cee_Dup),
+        create_instruction(Cee_Ldlen),
+        create_branch_instruction(Cee_Brfalse, empty),
+
+        create_instruction(Cee_Dup),
+        create_int_operand_instruction(Cee_Ldc_I4, 0),
+        create_token_operand_instruction(Cee_Ldelema, element_token),
+        create_store_local_instruction(pinned),
+        create_instruction(Cee_Ldlen),
+        create_instruction(Cee_Conv_I4),
+        create_load_local_instruction(pinned),
+        create_instruction(Cee_Conv_U),
+        create_instruction(Cee_Conv_U8),
+        create_branch_instruction(Cee_Br, done),
+
+        null_array,
+        create_int_operand_instruction(Cee_Ldc_I4, -1),
+        create_branch_instruction(Cee_Br, no_data),
+
+        empty,
+        create_instruction(Cee_Conv_I4),
+
+        no_data,
+        done
+    };
+}
+
+clrie::instruction_factory::instruction_sequence appmap::instrumentation::unpin_array(const clrie::type &element_type) const
+{
+    const auto pinned = pinned_element_locals.find(element_type.cor_element_type());
+    assert(pinned != pinned_element_locals.end() && "unpin_array() without pin_array()");
+    return {
+        create_int_operand_instruction(Cee_Ldc_I4, 0),
+        create_instruction(Cee_Conv_U),
+        create_store_local_instruction(pinned->second)
+    };
+}
+
+clrie::instruction_factory::instruction_sequence
+appmap::instrumentation::collection_count(const clrie::type &type, const instruction &not_collection) const
+{
+    if (type.cor_element_type() == ELEMENT_TYPE_SZARRAY) {
+        auto null_array = create_instruction(Cee_Pop);
+        auto done = create_instruction(Cee_Nop);
+        return {
+            create_instruction(Cee_Dup),
+            create_branch_instruction(Cee_Brfalse, null_array),
+            create_instruction(Cee_Ldlen),
+            create_instruction(Cee_Conv_I4),
+            create_branch_instruction(Cee_Br, done),
+            null_array,
+            create_int_operand_instruction(Cee_Ldc_I4, -1),
+            done
+        };
+    }
+
+    // ICollection, and the generic collection interfaces of the element type if the static type
+    // has a single type argument, as generic collections like HashSet<T> implement only those
+    constexpr COR_SIGNATURE get_count_sig[] = { IMAGE_CEE_CS_CALLCONV_DEFAULT_HASTHIS, 0, ELEMENT_TYPE_I4 };
+    const auto system_runtime = referenced_assembly(u"System.Runtime");
+    std::vector<mdToken> interfaces = { type_reference(system_runtime, u"System.Collections.ICollection") };
+    if (const auto element = single_type_argument(signature_of_type(type))) {
+        for (const auto name: { u"System.Collections.Generic.ICollection`1", u"System.Collections.Generic.IReadOnlyCollection`1" })
+            interfaces.push_back(type_token(appmap::signature::generic(type_reference(system_runtime, name), { *element })));
+    }
+
+    // The object is kept in a local, so that what isinst leaves on the stack can be counted.
+    // A null reference isn't an instance of anything, so it's left to the fallback too.
+    const auto object = locals().get(&ILocalVariableCollection::AddLocal, type);
+    instruction_sequence checks = { create_store_local_instruction(object) };
+    instruction_sequence counts;
+    const auto done = create_instruction(Cee_Nop);
+
+    for (const auto iface: interfaces) {
+        const auto count = create_token_operand_instruction(Cee_Callvirt, member_reference(iface, u"get_Count", get_count_sig));
+        checks += create_load_local_instruction(object);
+        checks += create_token_operand_instruction(Cee_Isinst, iface);
+        checks += create_instruction(Cee_Dup);
+        checks += create_branch_instruction(Cee_Brtrue, count);
+        checks += create_instruction(Cee_Pop);
+
+        counts += count;
+        counts += create_branch_instruction(Cee_Br, done);
+    }
+    checks += create_load_local_instruction(object);
+    checks += create_branch_instruction(Cee_Br, not_collection);
+
+    checks += counts;
+    checks += done;
+    return checks;
+}
+
+bool appmap::instrumentation::may_be_collection(const clrie::type &type) const
+{
+    const auto signature = signature_of_type(type);
+    if (signature[0] == ELEMENT_TYPE_SZARRAY)
+        return true;
+    // strings aren't references here, as they're captured as such
+    if (!is_reference(signature))
+        return false;
+
+    if (signature[0] != ELEMENT_TYPE_CLASS)
+        return true;
+    PCCOR_SIGNATURE p = &signature[1];
+    const auto token = CorSigUncompressToken(p);
+    return TypeFromToken(token) != mdtTypeDef || !is_sealed_non_collection(module().meta_data_import(), token);
+}
+
+bool appmap::instrumentation::is_reference_type(const clrie::type &type)
+{
+    return is_reference(signature_of_type(type));
+}
+
 clrie::instruction_factory::instruction_sequence
 appmap::instrumentation::capture_value(clrie::type &type) const noexcept
 {
@@ -212,45 +626,89 @@ appmap::instrumentation::capture_value(clrie::type &type) const noexcept
     return seq;
 }
 
-mdAssemblyRef appmap::instrumentation::assembly_reference(const char16_t *assembly)
+mdAssemblyRef appmap::instrumentation::referenced_assembly(const char16_t *assembly) const
 {
-    constexpr USHORT any_version = -1;
-    constexpr ASSEMBLYMETADATA any_metadata = {
-        any_version, any_version, any_version, any_version,
-        nullptr, 0, nullptr, 0, nullptr, 0
-    };
+    auto &c = context();
+    return c.get(c.referenced_assemblies, assembly, [this, assembly]() {
+        return find_assembly_ref(module().meta_data_assembly_import(), assembly);
+    });
+}
 
-    return module.meta_data_assembly_emit().get(
-        &IMetaDataAssemblyEmit::DefineAssemblyRef,
-        nullptr, 0, assembly, &any_metadata, nullptr, 0, 0
-    );
+mdAssemblyRef appmap::instrumentation::assembly_reference(const char16_t *assembly) const
+{
+    auto &c = context();
+    return c.get(c.assemblies, assembly, [this, assembly]() {
+        constexpr USHORT any_version = -1;
+        constexpr ASSEMBLYMETADATA any_metadata = {
+            any_version, any_version, any_version, any_version,
+            nullptr, 0, nullptr, 0, nullptr, 0
+        };
+
+        return module().meta_data_assembly_emit().get(
+            &IMetaDataAssemblyEmit::DefineAssemblyRef,
+            nullptr, 0, assembly, &any_metadata, nullptr, 0, 0
+        );
+    });
 }
 
-mdTypeRef appmap::instrumentation::type_reference(mdAssemblyRef assembly, const char16_t *type)
+mdTypeRef appmap::instrumentation::type_reference(mdAssemblyRef assembly, const char16_t *type) const
 {
-    return metadata.get(
-        &IMetaDataEmit::DefineTypeRefByName,
-        assembly, type
-    );
+    auto &c = context();
+    return c.get(c.types, {assembly, type}, [this, assembly, type]() {
+        return metadata().get(
+            &IMetaDataEmit::DefineTypeRefByName,
+            assembly, type
+        );
+    });
 }
 
-mdMemberRef appmap::instrumentation::member_reference(mdTypeRef type, const char16_t *member,
-    gsl::span<const COR_SIGNATURE> signature)
+mdMemberRef appmap::instrumentation::member_reference(mdToken type, const char16_t *member,
+    gsl::span<const COR_SIGNATURE> signature) const
 {
-    return metadata.get(
-        &IMetaDataEmit::DefineMemberRef, type,
-        member, signature.data(), signature.size()
-    );
+    auto &c = context();
+    return c.get(c.members, {type, member, {signature.begin(), signature.end()}}, [&]() {
+        return metadata().get(
+            &IMetaDataEmit::DefineMemberRef, type,
+            member, signature.data(), signature.size()
+        );
+    });
+}
+
+mdSignature appmap::instrumentation::signature_token(gsl::span<const COR_SIGNATURE> sig) const
+{
+    auto &c = context();
+    return c.get(c.signatures, {sig.begin(), sig.end()}, [&]() {
+        return metadata().get(&IMetaDataEmit::GetTokenFromSig, sig.data(), sig.size());
+    });
+}
+
+mdTypeSpec appmap::instrumentation::type_token(gsl::span<const COR_SIGNATURE> sig) const
+{
+    auto &c = context();
+    return c.get(c.type_specs, {sig.begin(), sig.end()}, [&]() {
+        return metadata().get(&IMetaDataEmit::GetTokenFromTypeSpec, sig.data(), sig.size());
+    });
+}
+
+mdToken appmap::instrumentation::define(const std::function<mdToken(const com::ptr<IMetaDataEmit> &)> &emit) const
+{
+    auto &c = context();
+    return c.define([&]() { return emit(c.metadata()); });
 }
 
 mdTypeDef appmap::instrumentation::define_type(const char16_t *name)
 {
-    return metadata.get(&IMetaDataEmit::DefineTypeDef, name, 0, type_reference(u"System.Runtime", u"System.Object"), nullptr);
+    const auto object = type_reference(u"System.Runtime", u"System.Object");
+    return define([&](const auto &metadata) {
+        return metadata.get(&IMetaDataEmit::DefineTypeDef, name, 0, object, nullptr);
+    });
 }
 
 mdFieldDef appmap::instrumentation::define_field(mdTypeDef type, const char16_t *name, gsl::span<const COR_SIGNATURE> signature)
 {
-    return metadata.get(&IMetaDataEmit::DefineField, type, name, 0, signature.data(), signature.size(), ELEMENT_TYPE_END, nullptr, 0);
+    return define([&](const auto &metadata) {
+        return metadata.get(&IMetaDataEmit::DefineField, type, name, 0, signature.data(), signature.size(), ELEMENT_TYPE_END, nullptr, 0);
+    });
 }
 
 mdMethodDef appmap::instrumentation::define_method(
@@ -260,10 +718,24 @@ mdMethodDef appmap::instrumentation::define_method(
     std::initializer_list<appmap::signature::type> locals,
     std::vector<appmap::cil::instruction> code
 ) {
-    const auto tok = metadata.get(&IMetaDataEmit::DefineMethod, type, name, 0, signature.data(), signature.size(), method.code_rva(), miManaged);
-    spdlog::trace("defining {}, instruction count: {}", utf8::utf16to8(name), code.size());
-    add_hook(tok, module.module_id(),
-        [locals = appmap::signature::locals(locals), code = std::move(code)](const auto &method) {
+    return define_method(type, name, signature, locals, {}, {}, std::move(code));
+}
+
+mdMethodDef appmap::instrumentation::define_method(
+    mdTypeDef type,
+    const char16_t *name,
+    gsl::span<const COR_SIGNATURE> signature,
+    std::initializer_list<appmap::signature::type> locals,
+    std::vector<appmap::cil::instruction> protected_code,
+    std::vector<appmap::cil::instruction> fault,
+    std::vector<appmap::cil::instruction> code
+) {
+    const auto tok = define([&](const auto &metadata) {
+        return metadata.get(&IMetaDataEmit::DefineMethod, type, name, 0, signature.data(), signature.size(), method.code_rva(), miManaged);
+    });
+    spdlog::trace("defining {}, instruction count: {}", utf8::utf16to8(name), protected_code.size() + code.size());
+    add_hook(tok, module_id(),
+        [locals = appmap::signature::locals(locals), protected_code = std::move(protected_code), fault = std::move(fault), code = std::move(code)](const auto &method) {
             com::hresult::check(method.local_variables()->ReplaceSignature(locals.data(), locals.size()));
 
             instrumentation instr(method);
@@ -272,6 +744,24 @@ mdMethodDef appmap::instrumentation::define_method(
 
             const auto ret = instr.create_instruction(Cee_Ret);
             graph.insert_after(nullptr, ret);
+
+            if (!protected_code.empty()) {
+                const auto rest = instr.create_instruction(Cee_Nop);
+                const auto leave = instr.create_branch_instruction(Cee_Leave, rest);
+                const auto end = instr.create_instruction(Cee_Endfinally);
+                auto handler = appmap::cil::compile(fault, instr);
+                handler += end;
+
+                auto block = appmap::cil::compile(protected_code, instr);
+                block += leave;
+                graph.insert_before(ret, block);
+                graph.insert_before(ret, handler);
+                graph.insert_before(ret, rest);
+
+                com::ptr<IExceptionClause> clause;
+                com::hresult::check(method.exception_section()->AddNewExceptionClause(
+                    COR_ILEXCEPTION_CLAUSE_FAULT, block.front(), leave, handler.front(), end, nullptr, mdTokenNil, &clause));
+            }
             graph.insert_before(ret, appmap::cil::compile(code, instr));
 
             return true;
@@ -1,5 +1,10 @@
 #pragma once
 #include <array>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
 #include <variant>
 #include <gsl/gsl-lite.hpp>
 
@@ -65,25 +70,32 @@ namespace appmap {
         };
     };
 
+    // What instrumentations of a module's methods share: its metadata interfaces,
+    // and references its code is instrumented with, emitted into its metadata once.
+    struct module_context;
+
+    // Use a single one for all the instrumentation of a method.
+    // Everything but the instruction factory is only looked up when first needed,
+    // and things of the module only once for all its methods.
     struct instrumentation : public clrie::instruction_factory {
         instrumentation(clrie::method_info method_info) :
             clrie::instruction_factory(method_info.instruction_factory()),
-            method(method_info),
-            module(method.module_info()),
-            module_id(module.module_id()),
-            metadata(module.meta_data_emit()),
-            type_factory(module.create_type_factory()),
-            locals(method.get(&IMethodInfo::GetLocalVariables))
+            method(method_info)
         {}
 
         clrie::method_info method;
-        clrie::module_info module;
-        const ModuleID module_id;
-        com::ptr<IMetaDataEmit> metadata;
-        com::ptr<ITypeCreator> type_factory;
-        com::ptr<ILocalVariableCollection> locals;
 
-        static com::ptr<ISignatureBuilder> signature_builder;
+        const clrie::module_info &module() const;
+        ModuleID module_id() const;
+        const com::ptr<IMetaDataEmit> &metadata() const;
+        const com::ptr<ITypeCreator> &type_factory() const;
+        const com::ptr<ILocalVariableCollection> &locals() const;
+
+        // Makes signature builders, one per thread, as methods are instrumented concurrently.
+        static com::ptr<IProfilerManager> profiler_manager;
+
+        // Drops the context of an unloaded module, as its id can be reused.
+        static void forget_module(ModuleID module);
 
         template <class F>
         instruction_sequence make_call(F f) const {
@@ -92,6 +104,44 @@ namespace appmap {
 
         instruction_sequence create_call_to_string(const clrie::type &type) const noexcept;
 
+        // Replaces the object reference on the stack with RuntimeHelpers.GetHashCode() of it.
+        instruction_sequence create_call_to_get_hash_code() const;
+        cil::instruction call_get_hash_code() const;
+
+        // Replaces the object on the stack with the full name of its runtime type.
+        instruction_sequence create_call_to_get_type_name() const;
+
+        // System.Object, as the type of catch clauses catching any exception.
+        mdTypeRef object_type() const;
+
+        // Replace the task on the stack with its Task.Status, as an int32, or its Task.Id.
+        cil::instruction call_task_status() const;
+        cil::instruction call_task_id() const;
+
+        // Pins the string on the stack and replaces it with a pointer to its UTF-16 characters
+        // (null for a null string) followed by its length, so it can be passed to native code
+        // without marshaling. The string stays pinned until unpin_string().
+        instruction_sequence pin_string() const;
+        instruction_sequence unpin_string() const;
+
+        // Pins the array on the stack, of the given primitive element type, and replaces it with
+        // its length (-1 for null) followed by a pointer to its first element (null if empty).
+        // The array stays pinned until unpin_array().
+        instruction_sequence pin_array(const clrie::type &element_type) const;
+        instruction_sequence unpin_array(const clrie::type &element_type) const;
+
+        // Replaces the array or collection on the stack with its length or Count (-1 for null).
+        // Collections are those implementing ICollection, or ICollection<T> or IReadOnlyCollection<T>
+        // of the single type argument of the static type, if any.
+        // Objects that aren't a collection are left on the stack and branch to not_collection.
+        instruction_sequence collection_count(const clrie::type &type, const instruction &not_collection) const;
+
+        // Whether a value of the type might be an array or a collection at runtime: reference types
+        // other than strings, unless sealed and known not to implement collection interfaces.
+        bool may_be_collection(const clrie::type &type) const;
+
+        static bool is_reference_type(const clrie::type &type);
+
         // Note capture_value takes a reference; in case of a composite type, it dereferences
         // it to a primitive that can be then passed onto the correct native function.
         // The argument is updated to reflect the resulting simple type.
@@ -100,32 +150,44 @@ namespace appmap {
         template <typename T>
         uint64_t add_local()
         {
-            auto t = type_factory.get(&ITypeCreator::FromCorElement, static_cast<CorElementType>(type_signature<T>()));
-            return locals.get(&ILocalVariableCollection::AddLocal, t);
+            auto t = type_factory().get(&ITypeCreator::FromCorElement, static_cast<CorElementType>(type_signature<T>()));
+            return locals().get(&ILocalVariableCollection::AddLocal, t);
+        }
+
+        uint64_t add_local(const clrie::type &type)
+        {
+            return locals().get(&ILocalVariableCollection::AddLocal, type);
         }
 
         // emit metadata and return reference tokens
+        // (references are cached per module, so each is only emitted once)
 
-        mdAssemblyRef assembly_reference(const char16_t *assembly);
+        mdAssemblyRef assembly_reference(const char16_t *assembly) const;
 
-        mdTypeRef type_reference(mdAssemblyRef assembly, const char16_t *type);
-        mdTypeRef type_reference(const char16_t *assembly, const char16_t *type) {
+        mdTypeRef type_reference(mdAssemblyRef assembly, const char16_t *type) const;
+        mdTypeRef type_reference(const char16_t *assembly, const char16_t *type) const {
             return type_reference(assembly_reference(assembly), type);
         }
 
-        mdMemberRef member_reference(mdTypeRef type, const char16_t *member,
-            gsl::span<const COR_SIGNATURE> signature);
+        mdMemberRef member_reference(mdToken type, const char16_t *member,
+            gsl::span<const COR_SIGNATURE> signature) const;
 
         mdMemberRef member_reference(mdAssemblyRef assembly, const char16_t *type,
-            const char16_t *member, gsl::span<const COR_SIGNATURE> signature) {
+            const char16_t *member, gsl::span<const COR_SIGNATURE> signature) const {
             return member_reference(type_reference(assembly, type), member, signature);
         }
 
         mdMemberRef member_reference(const char16_t *assembly, const char16_t *type,
-            const char16_t *member, gsl::span<const COR_SIGNATURE> signature) {
+            const char16_t *member, gsl::span<const COR_SIGNATURE> signature) const {
             return member_reference(type_reference(assembly, type), member, signature);
         }
 
+        mdSignature signature_token(gsl::span<const COR_SIGNATURE> sig) const;
+
+        // Emits definitions into the module's metadata, serialized with the other emits into it,
+        // as the metadata API isn't safe to call concurrently.
+        mdToken define(const std::function<mdToken(const com::ptr<IMetaDataEmit> &)> &emit) const;
+
         mdTypeDef define_type(const char16_t *name);
         mdFieldDef define_field(mdTypeDef type, const char16_t *name, gsl::span<const COR_SIGNATURE> signature);
 
@@ -141,17 +203,36 @@ namespace appmap {
             return define_method(type, name, signature, {}, std::move(code));
         }
 
+        // Defines a method starting with the protected code, which is left with an empty stack
+        // for the rest of the code, and whose fault handler runs if it throws.
+        mdMethodDef define_method(
+            mdTypeDef type,
+            const char16_t *name,
+            gsl::span<const COR_SIGNATURE> signature,
+            std::initializer_list<appmap::signature::type> locals,
+            std::vector<cil::instruction> protected_code,
+            std::vector<cil::instruction> fault,
+            std::vector<cil::instruction> code
+        );
+
         template <class Ret, class... Args>
-        mdTypeSpec native_type(Ret (*)(Args...)) {
-            constexpr auto sig = func_traits<Ret(*)(Args...)>::signature;
-            return metadata.get(&IMetaDataEmit::GetTokenFromSig, sig.data(), sig.size());
+        mdSignature native_type(Ret (*)(Args...)) const {
+            return signature_token(func_traits<Ret(*)(Args...)>::signature);
         }
 
-        mdTypeSpec type_token(gsl::span<const COR_SIGNATURE> sig) {
-            return metadata.get(&IMetaDataEmit::GetTokenFromTypeSpec, sig.data(), sig.size());
-        }
+        mdTypeSpec type_token(gsl::span<const COR_SIGNATURE> sig) const;
 
     protected:
         instruction_sequence make_call_sig(void *fn, gsl::span<const COR_SIGNATURE> signature) const;
+
+        // An existing reference to the assembly, or nil if the module doesn't have one.
+        mdAssemblyRef referenced_assembly(const char16_t *assembly) const;
+
+        module_context &context() const;
+        mutable std::shared_ptr<module_context> context_;
+        mutable com::ptr<ILocalVariableCollection> locals_;
+
+        mutable std::optional<uint64_t> pinned_string_local;
+        mutable std::unordered_map<CorElementType, uint64_t> pinned_element_locals;
     };
 }
@@ -0,0 +1,74 @@
+#include <doctest/doctest.h>
+
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+
+#include "concurrent.h"
+#include "intern.h"
+
+using namespace appmap;
+
+namespace {
+    struct string_table {
+        segmented_vector<std::string> strings;
+        // keys point into strings, which never move
+        concurrent_map<std::string_view, uint32_t> ids;
+        std::mutex mutex;  // serializes adding strings, so that each only gets one id
+
+        string_table() {
+            strings.push_back({});
+            ids.insert_or_assign(strings[0], 0);
+        }
+    };
+
+    string_table &table()
+    {
+        static string_table table;
+        return table;
+    }
+}
+
+interned_string::interned_string(std::string_view s)
+{
+    auto &t = table();
+    if (const auto id = t.ids.find(s)) {
+        id_ = *id;
+        return;
+    }
+
+    std::lock_guard lock(t.mutex);
+    if (const auto id = t.ids.find(s)) {
+        id_ = *id;
+        return;
+    }
+
+    const auto id = t.strings.push_back(std::string(s));
+    if (id > std::numeric_limits<uint32_t>::max())
+        throw std::length_error("too many interned strings");
+    id_ = static_cast<uint32_t>(id);
+    t.ids.insert_or_assign(t.strings[id], id_);
+}
+
+const std::string &interned_string::str() const noexcept
+{
+    return table().strings[id_];
+}
+
+TEST_CASE("string interning")
+{
+    const interned_string empty;
+    CHECK(empty.str().empty());
+    CHECK(interned_string("") == empty);
+
+    const interned_string a("System.String");
+    const std::string text = "System.String";
+    CHECK(interned_string(text) == a);
+    CHECK(interned_string(text).id() == a.id());
+    CHECK(a.str() == text);
+    CHECK(&interned_string("System.String").str() == &a.str());
+
+    const interned_string b("System.Int32");
+    CHECK(b != a);
+    CHECK(b.str() == "System.Int32");
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace appmap {
+    // A string in the global intern table, which keeps each distinct string once, forever.
+    // Interned strings are just 32-bit ids, so they're cheap to store and compare;
+    // the same id always means the same string.
+    class interned_string
+    {
+        uint32_t id_ = 0;  // the empty string
+
+    public:
+        interned_string() noexcept = default;
+        interned_string(std::string_view s);
+        interned_string(const std::string &s): interned_string(std::string_view(s)) {}
+        interned_string(const char *s): interned_string(std::string_view(s)) {}
+
+        const std::string &str() const noexcept;
+        operator const std::string &() const noexcept { return str(); }
+        uint32_t id() const noexcept { return id_; }
+
+        bool operator==(const interned_string &) const noexcept = default;
+    };
+}
@@ -1,11 +1,14 @@
 #include <spdlog/spdlog.h>
 #include <string>
 
+#include <dlfcn.h>
 #include <utf8.h>
 
+#include "concurrent.h"
 #include "generation.h"
 #include "method.h"
 #include "instrumentation.h"
+#include "plan.h"
 #include <fstream>
 
 using namespace appmap;
@@ -17,7 +20,7 @@ void appmap::instrumentation_method::initialize(com::ptr<IProfilerManager> manag
     spdlog::debug("initialize()");
     assert(profiler_info == nullptr);
     profiler_info = manager.get(&IProfilerManager::GetCorProfilerInfo);
-    instrumentation::signature_builder = manager.get(&IProfilerManager::CreateSignatureBuilder);
+    instrumentation::profiler_manager = manager;
 }
 
 void appmap::instrumentation_method::on_shutdown()
@@ -31,14 +34,32 @@ void appmap::instrumentation_method::on_shutdown()
     if (auto f = config.appmap_output_stream()) {
         *f << appmap::generate(recorder::events, config.generate_classmap) << std::endl;
     }
+
+    std::unique_lock lock(module_plans_mutex);
+    for (const auto &[_, entry]: module_plans)
+        if (entry.cache)
+            entry.plan->save(*entry.cache);
 }
 
 namespace {
     using method_ref = std::pair<mdMethodDef, ModuleID>;
-    using hook_point = std::variant<std::string, method_ref>;
+
+    // Packs the method token with the module into a single word to hash.
+    struct method_ref_hash {
+        uint64_t operator()(const method_ref &ref) const noexcept {
+            return hash_mix((static_cast<uint64_t>(ref.second) << 24) ^ ref.first);
+        }
+    };
+
+    // Hooks are added by static initializers, and by define_method while other threads are
+    // compiling methods, which all look hooks up on every method the JIT considers.
+    struct hook_registry {
+        concurrent_map<std::string, hook, std::hash<std::string_view>> by_name;
+        concurrent_map<method_ref, hook, method_ref_hash> by_ref;
+    };
 
     auto &hooks() {
-        static std::map<hook_point, hook> hooks;
+        static hook_registry hooks;
         return hooks;
     }
 
@@ -47,40 +68,222 @@ namespace {
         return rejits;
     }
 
-    std::optional<hook> find_hook(clrie::method_info &method)
+    // Splits a full method name into the type name and the method name.
+    std::pair<std::string, std::string> split_method_name(const std::string &method)
+    {
+        auto dot = method.find_last_of('.');
+        while (dot > 0 && method[dot - 1] == '.') dot--; // find the right dot in .ctor and the likes
+        return { method.substr(0, dot), method.substr(dot + 1) };
+    }
+
+    // Does the module define any type with methods hooked by name?
+    bool defines_hooked_type(const clrie::module_info &module)
+    {
+        const auto md = module.meta_data_import();
+        bool found = false;
+        hooks().by_name.for_each([&](const std::string &name, const hook &) {
+            mdTypeDef type;
+            if (!found && md->FindTypeDefByName(utf8::utf8to16(split_method_name(name).first).c_str(), 0, &type) == S_OK)
+                found = true;
+        });
+        return found;
+    }
+}
+
+namespace {
+    // Cached plans are only valid for the same configuration and the same named hooks.
+    // Identifies the build of the agent: its version, and the size and modification time
+    // of its library, which changes with every build even if the version doesn't.
+    std::string agent_build()
+    {
+        std::string build = APPMAP_AGENT_VERSION;
+        Dl_info info;
+        if (dladdr(reinterpret_cast<void *>(&agent_build), &info) && info.dli_fname) {
+            std::error_code size_error, time_error;
+            const std::filesystem::path library = info.dli_fname;
+            const auto size = std::filesystem::file_size(library, size_error);
+            const auto time = std::filesystem::last_write_time(library, time_error);
+            if (!size_error && !time_error)
+                return build + ' ' + std::to_string(size) + ' ' + std::to_string(static_cast<long long>(time.time_since_epoch().count()));
+        }
+        return build + " " __DATE__ " " __TIME__;
+    }
+
+    // Plans cached by another build of the agent, which may find and name things
+    // differently, or with another configuration or hooks, aren't used.
+    size_t plan_key(const appmap::config &config)
+    {
+        static const size_t key = [&config]() {
+            // summed, so that it doesn't depend on the order of the hooks
+            size_t names = 0;
+            hooks().by_name.for_each([&names](const std::string &name, const hook &) {
+                names += std::hash<std::string>{}(name);
+            });
+            return (config.fingerprint * 31 + names) * 31 + std::hash<std::string>{}(agent_build());
+        }();
+        return key;
+    }
+
+    std::optional<hook> find_hook(clrie::method_info &method, const module_plan *plan)
     {
         const auto &hs = hooks();
-        const auto name = method.full_name();
+        const auto token = method.method_token();
+
+        if (plan) {
+            if (const auto it = plan->named_hooks.find(token); it != plan->named_hooks.end())
+                if (const auto hook = hs.by_name.find(it->second))
+                    return *hook;
+        }
 
-        if (hs.count(name))
-            return hs.at(name);
+        if (const auto hook = hs.by_ref.find(method_ref{token, method.module_info().module_id()}))
+            return *hook;
 
-        const method_ref ref{method.method_token(), method.module_info().module_id()};
+        // the plan already knows about named hooks of any method it knows
+        if (plan && (*plan)[token] != method_verdict::unknown)
+            return {};
 
-        if (hs.count(ref))
-            return hs.at(ref);
+        if (const auto hook = hs.by_name.find(method.full_name()))
+            return *hook;
 
         return {};
     }
 }
 
+std::shared_ptr<const module_plan> appmap::instrumentation_method::plan_for(ModuleID module)
+{
+    std::shared_lock lock(module_plans_mutex);
+    if (const auto it = module_plans.find(module); it != module_plans.end())
+        return it->second.plan;
+    return nullptr;
+}
+
+namespace {
+    // Size of the IL code of a method, from the header of its body.
+    uint32_t il_code_size(const BYTE *header, ULONG size)
+    {
+        if (size >= 1 && (header[0] & 3) == CorILMethod_TinyFormat)
+            return header[0] >> 2;
+        if (size >= sizeof(IMAGE_COR_ILMETHOD_FAT))
+            return reinterpret_cast<const IMAGE_COR_ILMETHOD_FAT *>(header)->CodeSize;
+        return 0;
+    }
+
+    // Is the method too trivial to record, judging by its metadata alone?
+    bool is_trivial(const clrie::method_info &method, const config::trivial_methods &policy, const com::ptr<ICorProfilerInfo> &profiler)
+    {
+        if (policy.aggressive_inlining && (method.method_impl_flags() & miAggressiveInlining))
+            return true;
+
+        const auto token = method.method_token();
+        const auto module = method.module_info();
+
+        if (policy.accessors && (method.is_property_getter() || method.is_property_setter())
+            && module.meta_data_import()->GetCustomAttributeByName(token,
+                u"System.Runtime.CompilerServices.CompilerGeneratedAttribute", nullptr, nullptr) == S_OK)
+            return true;
+
+        if (policy.max_il_size) {
+            LPCBYTE header;
+            ULONG size;
+            // abstract and extern methods have no body
+            if (profiler->GetILFunctionBody(module.module_id(), token, &header, &size) == S_OK
+                && il_code_size(header, size) <= policy.max_il_size)
+                return true;
+        }
+
+        return false;
+    }
+}
+
+namespace {
+    bool has_attribute(const com::ptr<IMetaDataImport> &md, mdToken token, const std::vector<std::u16string> &attributes)
+    {
+        for (const auto &attribute: attributes)
+            if (md->GetCustomAttributeByName(token, attribute.c_str(), nullptr, nullptr) == S_OK)
+                return true;
+        return false;
+    }
+
+    // Closures and state machines are nested in the type of the method they come from,
+    // so a type is excluded along with any type it's nested in.
+    bool is_excluded_type(const com::ptr<IMetaDataImport> &md, mdTypeDef type, const std::vector<std::u16string> &attributes, const module_plan *plan)
+    {
+        if (plan)
+            if (const auto known = plan->excluded_types.find(type))
+                return *known;
+
+        bool excluded = has_attribute(md, type, attributes);
+        mdTypeDef enclosing;
+        if (!excluded && md->GetNestedClassProps(type, &enclosing) == S_OK)
+            excluded = is_excluded_type(md, enclosing, attributes, plan);
+
+        if (plan)
+            plan->excluded_types.insert_or_assign(type, excluded);
+        return excluded;
+    }
+
+    bool is_excluded(const clrie::method_info &method, const std::vector<std::u16string> &attributes, const module_plan *plan)
+    {
+        const auto md = method.module_info().meta_data_import();
+        const auto token = method.method_token();
+
+        mdTypeDef type;
+        if (md->GetMethodProps(token, &type, nullptr, 0, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr) == S_OK
+            && is_excluded_type(md, type, attributes, plan))
+            return true;
+
+        return has_attribute(md, token, attributes);
+    }
+}
+
 bool appmap::instrumentation_method::should_instrument_method(clrie::method_info method, [[maybe_unused]] bool is_rejit)
 {
-    return find_hook(method) || config.should_instrument(method);
+    const auto plan = plan_for(method.module_info().module_id());
+    if (plan && plan->folded_state_machines.find(method.method_token()))
+        return true;
+
+    const auto filtered_out = [&]() {
+        return (config.skip_trivial.any() && is_trivial(method, config.skip_trivial, profiler_info))
+            || (!config.exclude_attributes.empty() && is_excluded(method, config.exclude_attributes, plan.get()));
+    };
+
+    if (plan) {
+        switch (plan->verdict) {
+            case module_verdict::excluded:
+                return false;
+            case module_verdict::included:
+                return find_hook(method, plan.get()) || !filtered_out();
+            case module_verdict::per_method:
+                break;
+        }
+
+        switch ((*plan)[method.method_token()]) {
+            case method_verdict::skip:
+                return false;
+            case method_verdict::instrument:
+                // hooks replace the instrumentation, so they apply to methods filtered out too
+                return find_hook(method, plan.get()) || !filtered_out();
+            case method_verdict::unknown:
+                break;
+        }
+    }
+
+    return find_hook(method, plan.get()) || (config.should_instrument(method) && !filtered_out());
 }
 
 void appmap::instrumentation_method::instrument_method(clrie::method_info method, [[maybe_unused]] bool is_rejit)
 {
-    const auto &name = method.full_name();
+    if (spdlog::should_log(spdlog::level::trace))
+        spdlog::trace("instrument_method({}, {})", method.full_name(), is_rejit);
 
-    spdlog::trace("instrument_method({}, {})", name, is_rejit);
-
-    if (const auto hook = find_hook(method))
+    const auto plan = plan_for(method.module_info().module_id());
+    if (const auto hook = find_hook(method, plan.get()))
         if ((*hook)(method))
             return;
 
-    recorder::instrument(method);
-    spdlog::trace("instrument_method({}, {}) finished", method.full_name(), is_rejit);
+    recorder::instrument(method, plan.get());
+    if (spdlog::should_log(spdlog::level::trace))
+        spdlog::trace("instrument_method({}, {}) finished", method.full_name(), is_rejit);
 }
 
 void appmap::instrumentation_method::on_module_loaded(clrie::module_info module)
@@ -88,20 +291,40 @@ void appmap::instrumentation_method::on_module_loaded(clrie::module_info module)
     const auto name = module.module_name();
     modules.insert(name);
 
+    const auto cache = module_plan::cache_path(module, plan_key(config));
+    std::shared_ptr<const module_plan> plan = cache ? module_plan::load(*cache) : nullptr;
+
+    if (plan) {
+        spdlog::debug("module {} plan loaded from {}", name, cache->string());
+    } else {
+        auto verdict = config.should_instrument(module);
+        if (verdict == module_verdict::excluded && defines_hooked_type(module))
+            verdict = module_verdict::per_method;
+        spdlog::debug("module {} verdict: {}", name, static_cast<int>(verdict));
+
+        plan = std::make_shared<const module_plan>(module, config, verdict, [](const std::string &method) {
+            return hooks().by_name.find(method) != nullptr;
+        });
+    }
+
+    {
+        std::unique_lock lock(module_plans_mutex);
+        module_plans[module.module_id()] = { std::move(plan), cache };
+    }
+
     if (const auto &rejits = requested_rejits(); rejits.count(name)) {
         const auto md = module.meta_data_import();
         for (const auto &method: rejits.at(name)) {
-            auto dot = method.find_last_of('.');
-            while (dot > 0 && method[dot - 1] == '.') dot--; // find the right dot in .ctor and the likes
+            const auto [type_name, method_name] = split_method_name(method);
 
             mdToken type;
-            if (md->FindTypeDefByName(utf8::utf8to16(method.substr(0, dot)).c_str(), 0, &type) != S_OK) {
-                spdlog::warn("type {} not found in {}", method.substr(0, dot), name);
+            if (md->FindTypeDefByName(utf8::utf8to16(type_name).c_str(), 0, &type) != S_OK) {
+                spdlog::warn("type {} not found in {}", type_name, name);
                 continue;
             }
 
             mdToken function;
-            if (md->FindMethod(type, utf8::utf8to16(method.substr(dot + 1)).c_str(), nullptr, 0, &function) != S_OK) {
+            if (md->FindMethod(type, utf8::utf8to16(method_name).c_str(), nullptr, 0, &function) != S_OK) {
                 spdlog::warn("method {} not found in {}", method, name);
                 continue;
             }
@@ -112,20 +335,32 @@ void appmap::instrumentation_method::on_module_loaded(clrie::module_info module)
     }
 }
 
+void appmap::instrumentation_method::on_module_unloaded(clrie::module_info module)
+{
+    instrumentation::forget_module(module.module_id());
+
+    std::unique_lock lock(module_plans_mutex);
+    if (const auto it = module_plans.find(module.module_id()); it != module_plans.end()) {
+        if (it->second.cache)
+            it->second.plan->save(*it->second.cache);
+        module_plans.erase(it);
+    }
+}
+
 hook appmap::add_hook(const std::string &method_name, hook handler)
 {
-    return hooks()[method_name] = handler;
+    return hooks().by_name.insert_or_assign(method_name, std::move(handler));
 }
 
 hook appmap::add_hook(const std::string &method_name, const std::string &module_name, hook handler)
 {
     requested_rejits()[module_name].push_back(method_name);
-    return hooks()[method_name] = handler;
+    return hooks().by_name.insert_or_assign(method_name, std::move(handler));
 }
 
 hook appmap::add_hook(mdMethodDef method, ModuleID module, hook handler)
 {
-    return hooks()[method_ref{method, module}] = handler;
+    return hooks().by_ref.insert_or_assign(method_ref{method, module}, std::move(handler));
 }
 
 uint64_t appmap::current_thread_id()
@@ -1,5 +1,8 @@
 #pragma once
 #include <map>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "clrie/instrumentation_method.h"
@@ -7,6 +10,7 @@
 #include "clrie/module_info.h"
 
 #include "config.h"
+#include "plan.h"
 #include "recorder.h"
 
 namespace appmap {
@@ -20,7 +24,17 @@ namespace appmap {
         bool should_instrument_method(clrie::method_info method, bool is_rejit);
         void instrument_method(clrie::method_info method, bool is_rejit);
         void on_module_loaded(clrie::module_info module);
+        void on_module_unloaded(clrie::module_info module);
         void on_shutdown();
+
+    private:
+        struct plan_entry {
+            std::shared_ptr<const module_plan> plan;
+            std::optional<std::filesystem::path> cache;
+        };
+        std::unordered_map<ModuleID, plan_entry> module_plans;
+        std::shared_mutex module_plans_mutex;
+        std::shared_ptr<const module_plan> plan_for(ModuleID module);
     };
 
     using hook = std::function<bool(const clrie::method_info &)>;
@@ -1,24 +1,32 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include <cor.h>
 #include <corprof.h>
 #undef __valid
 
+#include "concurrent.h"
+#include "intern.h"
+
 namespace appmap {
+    // Names are interned, since the same ones repeat across many methods.
     struct parameter_info {
-        std::string type;
-        std::string name;
+        interned_string type;
+        interned_string name;
+        bool captured = true;  // false if only the type is recorded
     };
 
     struct method_info {
-        std::string defined_class;
-        std::string method_id;
+        interned_string defined_class;
+        interned_string method_id;
         bool is_static;
-        std::string return_type;
+        interned_string return_type;
         std::vector<parameter_info> parameters{};
+        bool return_type_only = false;
     };
 
-    inline std::vector<method_info> method_infos;
+    // Indexed by the function ids compiled into instrumented methods.
+    inline segmented_vector<method_info> method_infos;
 }
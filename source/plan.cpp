@@ -0,0 +1,239 @@
+#include <doctest/doctest.h>
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+#include <utf8.h>
+
+#include <array>
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+#include "plan.h"
+
+namespace fs = std::filesystem;
+using namespace appmap;
+using nlohmann::json;
+
+namespace {
+    // Calls f with each token an IMetaDataImport::Enum* method gives.
+    template <typename Enum, typename F>
+    void for_each_token(const com::ptr<IMetaDataImport> &md, Enum enumerate, F f)
+    {
+        HCORENUM it = nullptr;
+        std::array<mdToken, 64> tokens;
+        ULONG count;
+
+        while (enumerate(&it, tokens.data(), tokens.size(), &count) == S_OK && count > 0)
+            for (ULONG i = 0; i < count; i++)
+                f(tokens[i]);
+
+        if (it)
+            md->CloseEnum(it);
+    }
+
+    constexpr char verdict_chars[] = { '?', '-', '+' };  // by method_verdict
+
+    std::string mvid_string(const GUID &mvid)
+    {
+        char buffer[33];
+        std::snprintf(buffer, sizeof(buffer), "%08x%04x%04x%02x%02x%02x%02x%02x%02x%02x%02x",
+            mvid.Data1, mvid.Data2, mvid.Data3,
+            mvid.Data4[0], mvid.Data4[1], mvid.Data4[2], mvid.Data4[3],
+            mvid.Data4[4], mvid.Data4[5], mvid.Data4[6], mvid.Data4[7]);
+        return buffer;
+    }
+}
+
+module_plan::module_plan(const clrie::module_info &module, const config &config, module_verdict v,
+    const std::function<bool(const std::string &)> &is_hooked):
+    verdict(v), changed(true)
+{
+    if (verdict != module_verdict::per_method)
+        return;
+
+    const auto md = module.meta_data_import();
+
+    for_each_token(md, [&md](auto... args) { return md->EnumTypeDefs(args...); }, [&](mdTypeDef type) {
+        char16_t name[1024];
+        DWORD flags;
+        if (md->GetTypeDefProps(type, name, 1024, nullptr, &flags, nullptr) != S_OK || IsTdNested(flags))
+            return;
+        const auto type_name = utf8::utf16to8(std::u16string(name)) + ".";
+
+        for_each_token(md, [&md, type](HCORENUM *it, mdMethodDef *tokens, ULONG max, ULONG *count) {
+            return md->EnumMethods(it, type, tokens, max, count);
+        }, [&](mdMethodDef method) {
+            if (md->GetMethodProps(method, nullptr, name, 1024, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr) != S_OK)
+                return;
+            auto full_name = type_name + utf8::utf16to8(std::u16string(name));
+
+            auto result = method_verdict::skip;
+            if (is_hooked(full_name)) {
+                named_hooks[method] = std::move(full_name);
+                result = method_verdict::instrument;
+            } else if (config.should_instrument(module, full_name)) {
+                result = method_verdict::instrument;
+            }
+
+            const auto rid = RidFromToken(method);
+            if (rid >= methods.size())
+                methods.resize(rid + 1, method_verdict::unknown);
+            methods[rid] = result;
+        });
+    });
+}
+
+std::optional<method_names> module_plan::names(mdMethodDef method) const
+{
+    std::lock_guard lock(names_mutex);
+    if (const auto it = method_names_by_token.find(method); it != method_names_by_token.end())
+        return it->second;
+    return std::nullopt;
+}
+
+void module_plan::add_names(mdMethodDef method, method_names names) const
+{
+    std::lock_guard lock(names_mutex);
+    method_names_by_token.insert_or_assign(method, std::move(names));
+    changed = true;
+}
+
+void module_plan::mark_changed() const
+{
+    std::lock_guard lock(names_mutex);
+    changed = true;
+}
+
+std::optional<fs::path> module_plan::cache_path(const clrie::module_info &module, size_t key)
+{
+    // dynamic modules are generated anew every time, and have no stable identity
+    if (module.is_dynamic())
+        return std::nullopt;
+
+    // path filters decide by where the module is, so the same module loaded from elsewhere gets another plan
+    key = hash_mix(key ^ std::hash<std::string>{}(module.full_path()));
+    char key_string[17];
+    std::snprintf(key_string, sizeof(key_string), "%016zx", key);
+
+    const auto dir = config::instance().appmap_output_dir() / ".plans";
+    std::error_code error;
+    fs::create_directories(dir, error);
+    if (error) {
+        static std::once_flag warned;
+        std::call_once(warned, [&]() {
+            spdlog::warn("not caching instrumentation plans, couldn't create {}: {}", dir.string(), error.message());
+        });
+        return std::nullopt;
+    }
+    return dir / (mvid_string(module.mvid()) + "-" + key_string + ".json");
+}
+
+std::shared_ptr<module_plan> module_plan::load(const fs::path &path)
+{
+    std::ifstream file(path);
+    if (!file)
+        return nullptr;
+
+    try {
+        const auto j = json::parse(file);
+
+        auto plan = std::make_shared<module_plan>(static_cast<module_verdict>(j.at("verdict").get<int>()));
+
+        for (const auto c: j.at("methods").get<std::string>()) {
+            const auto verdict = std::find(std::begin(verdict_chars), std::end(verdict_chars), c);
+            if (verdict == std::end(verdict_chars))
+                throw std::runtime_error("invalid method verdict");
+            plan->methods.push_back(static_cast<method_verdict>(verdict - std::begin(verdict_chars)));
+        }
+
+        for (const auto &hook: j.at("hooks"))
+            plan->named_hooks[hook.at(0).get<mdMethodDef>()] = hook.at(1).get<std::string>();
+
+        for (const auto &names: j.at("names")) {
+            method_names entry{ names.at("class"), {}, {}, names.at("return") };
+            for (const auto &param: names.at("parameters")) {
+                entry.parameter_types.push_back(param.at(0));
+                entry.parameter_names.push_back(param.at(1));
+            }
+            plan->method_names_by_token.emplace(names.at("token").get<mdMethodDef>(), std::move(entry));
+        }
+
+        return plan;
+    } catch (const std::exception &e) {
+        spdlog::warn("ignoring broken instrumentation plan cache {}: {}", path.string(), e.what());
+        return nullptr;
+    }
+}
+
+void module_plan::save(const fs::path &path) const
+{
+    std::lock_guard lock(names_mutex);
+    if (!changed)
+        return;
+
+    json j;
+    j["verdict"] = static_cast<int>(verdict);
+
+    std::string method_verdicts;
+    method_verdicts.reserve(methods.size());
+    for (const auto v: methods)
+        method_verdicts += verdict_chars[static_cast<size_t>(v)];
+    j["methods"] = std::move(method_verdicts);
+
+    j["hooks"] = json::array();
+    for (const auto &[token, name]: named_hooks)
+        j["hooks"].push_back({ token, name });
+
+    j["names"] = json::array();
+    for (const auto &[token, names]: method_names_by_token) {
+        json params = json::array();
+        for (size_t i = 0; i < names.parameter_types.size(); i++)
+            params.push_back({ names.parameter_types[i], names.parameter_names.at(i) });
+        j["names"].push_back({
+            { "token", token },
+            { "class", names.defined_class },
+            { "parameters", std::move(params) },
+            { "return", names.return_type }
+        });
+    }
+
+    // other processes might be writing the same plan; the one renamed last wins
+    auto temp = path;
+    temp += "." + std::to_string(std::random_device()()) + ".tmp";
+    try {
+        {
+            std::ofstream file(temp);
+            file.exceptions(std::ios::failbit | std::ios::badbit);
+            file << j;
+        }
+        fs::rename(temp, path);
+        changed = false;
+    } catch (const std::exception &e) {
+        spdlog::warn("couldn't save instrumentation plan cache {}: {}", path.string(), e.what());
+        std::error_code ec;
+        fs::remove(temp, ec);
+    }
+}
+
+TEST_CASE("instrumentation plan cache")
+{
+    const auto path = fs::temp_directory_path() / ("appmap-plan-test-" + std::to_string(std::random_device()()) + ".json");
+
+    module_plan plan;
+    plan.methods = { method_verdict::unknown, method_verdict::skip, method_verdict::instrument };
+    plan.named_hooks[0x06000002] = "Some.Class.Hooked";
+    plan.add_names(0x06000002, { "Some.Class", { "I4", "STRING" }, { "count", "label" }, "System.Uri" });
+    plan.save(path);
+
+    const auto loaded = module_plan::load(path);
+    fs::remove(path);
+
+    REQUIRE(loaded);
+    CHECK(loaded->verdict == module_verdict::per_method);
+    CHECK(loaded->methods == plan.methods);
+    CHECK((*loaded)[0x06000002] == method_verdict::instrument);
+    CHECK((*loaded)[0x06000010] == method_verdict::unknown);
+    CHECK(loaded->named_hooks == plan.named_hooks);
+    CHECK(loaded->names(0x06000002) == plan.names(0x06000002));
+    CHECK(!loaded->names(0x06000001));
+}
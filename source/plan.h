@@ -0,0 +1,74 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "concurrent.h"
+#include "config.h"
+#include "type.h"
+
+namespace appmap {
+    enum class method_verdict : uint8_t { unknown, skip, instrument };
+
+    // Names describing a method in the appmap, which take many metadata lookups to find out.
+    struct method_names {
+        std::string defined_class;
+        std::vector<std::string> parameter_types;  // friendly names, not including the receiver
+        std::vector<std::string> parameter_names;
+        std::string return_type;
+
+        bool operator==(const method_names &) const = default;
+    };
+
+    // What to do with the methods of a module, decided when it's loaded.
+    // Plans of modules that don't change between runs are kept in a cache directory,
+    // keyed by module MVID and path, the configuration and the agent build, along with the names of instrumented methods.
+    struct module_plan {
+        module_verdict verdict;
+
+        // only for per-method modules; methods of nested types and methods
+        // defined after the module was loaded are unknown
+        std::vector<method_verdict> methods;  // by RID of the method token
+        std::unordered_map<mdMethodDef, std::string> named_hooks;  // full names of hooked methods
+
+        method_verdict operator[](mdMethodDef method) const noexcept {
+            const auto rid = RidFromToken(method);
+            return rid < methods.size() ? methods[rid] : method_verdict::unknown;
+        }
+
+        // Lists methods of a per-method module from its metadata.
+        module_plan(const clrie::module_info &module, const config &config, module_verdict verdict,
+            const std::function<bool(const std::string &)> &is_hooked);
+        module_plan(module_verdict v = module_verdict::per_method): verdict(v) {}
+
+        // Names are filled in as methods get instrumented.
+        std::optional<method_names> names(mdMethodDef method) const;
+        void add_names(mdMethodDef method, method_names names) const;
+        // Names of the module's types, for methods whose names aren't known yet.
+        // Not cached across runs; names of the methods are.
+        mutable type_name_cache type_names;
+        // Whether each type, or any type it's nested in, has one of the exclude_attributes.
+        mutable concurrent_map<mdTypeDef, bool> excluded_types;
+        // MoveNext of the state machines of recorded async methods, which report when the calls
+        // return, so they're instrumented whatever the filters say. Not cached across runs.
+        mutable concurrent_map<mdMethodDef, bool> folded_state_machines;
+
+        // Cache file of the plan for a module, or nullopt if it can't be cached.
+        static std::optional<std::filesystem::path> cache_path(const clrie::module_info &module, size_t key);
+        static std::shared_ptr<module_plan> load(const std::filesystem::path &path);
+        // Only writes the file if the plan has changed since it was created or loaded.
+        void save(const std::filesystem::path &path) const;
+        void mark_changed() const;
+
+    private:
+        mutable std::mutex names_mutex;  // guards the two below
+        mutable std::unordered_map<mdMethodDef, method_names> method_names_by_token;
+        mutable bool changed = false;
+    };
+}
@@ -1,13 +1,22 @@
 #include <doctest/doctest.h>
 #include <spdlog/spdlog.h>
 #include <spdlog/fmt/bundled/ranges.h>
+#include <utf8.h>
+
+#include <algorithm>
+#include <functional>
 
 #include "recorder.h"
 
+#include "cil.h"
+#include "config.h"
+#include "plan.h"
+#include "signature.h"
 #include "instrumentation.h"
 #include "method.h"
 #include "method_info.h"
 #include "type.h"
+#include "utf16.h"
 
 using namespace appmap;
 
@@ -18,111 +27,738 @@ namespace appmap::recorder {
 namespace {
     thread_local std::vector<cor_value> arguments;
 
+    // Set while the thread runs code on behalf of the recorder, such as ToString() of
+    // a captured value. Probes leave capture on every path out, exceptional ones included.
+    thread_local bool capturing = false;
+}
+
+bool recorder::enter_capture()
+{
+    if (capturing)
+        return true;
+
+    capturing = true;
+    return false;
+}
+
+void recorder::leave_capture()
+{
+    capturing = false;
+}
+
+namespace {
+    // Recorded calls the thread is in, innermost last; only kept if call depth is limited.
+    struct open_call {
+        function_call_event *call;
+        uint32_t recursion;  // nested calls of the same method directly, including this one
+        size_t skipped = 0;  // calls made from this one, but beyond the limits
+    };
+    thread_local std::vector<open_call> open_calls;
+
+    bool limits_depth(const config &config) noexcept
+    {
+        return config.max_depth || config.max_recursion;
+    }
+
+    // Like enter_capture(), but also skips calls beyond the call depth limits, counting them
+    // on the innermost recorded call. That's all a skipped call costs, as this is checked
+    // before any of its arguments are captured.
+    bool enter_call(FunctionID function)
+    {
+        if (recorder::enter_capture())
+            return true;
+        if (open_calls.empty())
+            return false;
+
+        const auto &config = config::instance();
+        auto &caller = open_calls.back();
+        if ((config.max_depth && open_calls.size() >= config.max_depth)
+            || (config.max_recursion && caller.call->function == function && caller.recursion >= config.max_recursion)) {
+            caller.skipped++;
+            recorder::leave_capture();
+            return true;
+        }
+        return false;
+    }
+
+    // Closes the call on the thread, along with any calls left open by an exception
+    // in a method that couldn't record it. Calls closed on another thread (such as
+    // async ones) aren't open on this one.
+    void close_call(const call_event *call)
+    {
+        const auto it = std::find_if(open_calls.rbegin(), open_calls.rend(),
+            [call](const open_call &open) { return open.call == call; });
+        if (it == open_calls.rend())
+            return;
+
+        for (auto closed = open_calls.rbegin(); closed != std::next(it); ++closed)
+            closed->call->skipped_calls = closed->skipped;
+        open_calls.erase(std::next(it).base(), open_calls.end());
+    }
+
+    // Calls the thread is in which aren't in the recording yet, outermost first; only used
+    // with min_duration. A call is committed along with the calls it's nested in once it
+    // returns slow enough or something in it is kept, and dropped if it returns fast.
+    // That way the recording only grows with slow calls.
+    thread_local std::vector<std::unique_ptr<function_call_event>> staged_calls;
+
+    // Needs recorder::mutex held.
+    void commit_staged()
+    {
+        for (auto &call: staged_calls)
+            recorder::events.push_back(std::move(call));
+        staged_calls.clear();
+    }
+
+    // Whether the return is to be recorded. Calls staged after the one returning
+    // never returned themselves (because of an exception), so they're dropped with it.
+    // Calls not staged were committed already, possibly on another thread.
+    bool commit_return(const return_event &ret)
+    {
+        const auto it = std::find_if(staged_calls.rbegin(), staged_calls.rend(),
+            [&ret](const auto &call) { return call.get() == ret.call; });
+        if (it == staged_calls.rend())
+            return true;
+
+        const bool slow = ret.time - ret.call->time >= config::instance().min_duration;
+        staged_calls.erase(slow ? it.base() : std::next(it).base(), staged_calls.end());
+        if (slow)
+            commit_staged();
+        return slow;
+    }
+
+    // Needs recorder::mutex held.
+    void push_return(std::unique_ptr<return_event> event)
+    {
+        if (!open_calls.empty())
+            close_call(event->call);
+        if (!staged_calls.empty() && !commit_return(*event))
+            return;
+        recorder::events.push_back(std::move(event));
+    }
+
     const call_event *method_called(FunctionID id)
     {
+        recorder::leave_capture();
         std::lock_guard lock(appmap::recorder::mutex);
-        if (spdlog::get_level() >= spdlog::level::trace) {
+        if (spdlog::should_log(spdlog::level::trace)) {
             const auto &method_info = method_infos.at(id);
-            spdlog::trace("{}({}.{})", __FUNCTION__, method_info.defined_class, method_info.method_id);
+            spdlog::trace("{}({}.{})", __FUNCTION__, method_info.defined_class.str(), method_info.method_id.str());
         }
         auto event = std::make_unique<function_call_event>(current_thread_id(), id, std::exchange(arguments, {}));
         auto ptr = event.get();
-        recorder::events.push_back(std::move(event));
+        const auto &config = config::instance();
+        if (config.min_duration.count())
+            staged_calls.push_back(std::move(event));
+        else
+            recorder::events.push_back(std::move(event));
+
+        if (limits_depth(config)) {
+            const bool recursive = !open_calls.empty() && open_calls.back().call->function == id;
+            open_calls.push_back({ptr, recursive ? open_calls.back().recursion + 1 : 1});
+        }
         return ptr;
     }
 
     void method_returned_void(const function_call_event *call)
     {
+        recorder::leave_capture();
         std::lock_guard lock(appmap::recorder::mutex);
-        if (spdlog::get_level() >= spdlog::level::trace && call) {
+        if (spdlog::should_log(spdlog::level::trace) && call) {
             const auto &method_info = method_infos.at(call->function);
-            spdlog::trace("{}({}.{})", __FUNCTION__, method_info.defined_class, method_info.method_id);
+            spdlog::trace("{}({}.{})", __FUNCTION__, method_info.defined_class.str(), method_info.method_id.str());
         }
-        recorder::events.push_back(std::make_unique<return_event>(current_thread_id(), call));
+        push_return(std::make_unique<return_event>(current_thread_id(), call));
+    }
+
+    // Calls of async methods whose task hasn't completed yet, by id of the task. Tasks completed
+    // by the time their method returns them, such as the cached ones many calls can share, are
+    // never pending. Tasks can complete on any thread, so this isn't per thread.
+    // Guarded by recorder::mutex.
+    std::unordered_map<int32_t, const function_call_event *> pending_async_calls;
+
+    // TaskStatus.RanToCompletion, followed by Canceled and Faulted, which count as throwing.
+    constexpr int32_t task_ran_to_completion = 5;
+
+    void push_async_return(const function_call_event *call, bool threw)
+    {
+        auto event = std::make_unique<return_event>(current_thread_id(), call);
+        event->threw = threw;
+        push_return(std::move(event));
+    }
+
+    // Called when an async method returns its task, with the status and id of the task.
+    // Returns whether the call was left pending, in which case async_status is called
+    // with the status read again.
+    bool async_returned(int32_t status, int32_t task, const function_call_event *call)
+    {
+        recorder::leave_capture();
+        std::lock_guard lock(appmap::recorder::mutex);
+        if (status >= task_ran_to_completion) {
+            push_async_return(call, status != task_ran_to_completion);
+            return false;
+        }
+
+        // how long it takes isn't known yet, so it's kept
+        commit_staged();
+        // but it's done with the thread, which goes on to other calls
+        if (!open_calls.empty())
+            close_call(call);
+        pending_async_calls[task] = call;
+        return true;
+    }
+
+    // The task can complete after its status was read but before the call was left pending,
+    // in which case async_completed didn't find the call, so the status is checked once more.
+    void async_status(int32_t status, int32_t task)
+    {
+        if (status < task_ran_to_completion)
+            return;
+
+        std::lock_guard lock(appmap::recorder::mutex);
+        if (const auto it = pending_async_calls.find(task); it != pending_async_calls.end()) {
+            const auto call = it->second;
+            pending_async_calls.erase(it);
+            push_async_return(call, status != task_ran_to_completion);
+        }
+    }
+
+    // Called by the state machine of an async method once it has set the result or exception of its task.
+    // Tasks of calls that weren't recorded, or that are already known to be completed, are ignored.
+    void async_completed(int32_t task, bool threw)
+    {
+        std::lock_guard lock(appmap::recorder::mutex);
+        if (const auto it = pending_async_calls.find(task); it != pending_async_calls.end()) {
+            const auto call = it->second;
+            pending_async_calls.erase(it);
+            push_async_return(call, threw);
+        }
+    }
+
+    TEST_CASE("call depth limits") {
+        auto &config = config::instance();
+        const auto restore = gsl::finally([&config]() {
+            config.max_depth = config.max_recursion = 0;
+            open_calls.clear();
+            recorder::events.clear();
+        });
+        recorder::events.clear();
+        const auto fun = method_infos.push_back({"Some.Class", "Recurse", true, "System.Void"});
+        const auto other = method_infos.push_back({"Some.Class", "Other", true, "System.Void"});
+        const auto call = [](size_t id) {
+            return static_cast<const function_call_event *>(enter_call(id) ? nullptr : method_called(id));
+        };
+
+        SUBCASE("depth") {
+            config.max_depth = 2;
+            const auto outer = call(fun);
+            const auto inner = call(other);
+            REQUIRE(outer);
+            REQUIRE(inner);
+            CHECK(!call(fun));
+            CHECK(!call(other));
+            method_returned_void(inner);
+            CHECK(call(other));
+            method_returned_void(outer);
+            CHECK(inner->skipped_calls == 2);
+            CHECK(outer->skipped_calls == 0);
+        }
+
+        SUBCASE("recursion") {
+            config.max_recursion = 2;
+            const auto outer = call(fun);
+            const auto inner = call(fun);
+            REQUIRE(inner);
+            CHECK(!call(fun));
+            const auto leaf = call(other);
+            CHECK(leaf);
+            // left open by an exception
+            CHECK(call(fun));
+            method_returned_void(outer);
+            CHECK(inner->skipped_calls == 1);
+            CHECK(open_calls.empty());
+        }
+
+        SUBCASE("pending async call") {
+            config.max_depth = 1;
+            const auto stub = call(fun);
+            REQUIRE(stub);
+            CHECK(!call(other));
+            CHECK(async_returned(1, 99, stub));
+            CHECK(open_calls.empty());
+            CHECK(stub->skipped_calls == 1);
+            CHECK(call(other));
+            pending_async_calls.clear();
+        }
+
+        SUBCASE("returns of calls open on other threads") {
+            config.max_depth = 1;
+            const auto outer = call(fun);
+            REQUIRE(outer);
+            CHECK(!call(other));
+            const function_call_event elsewhere{7, other};
+            close_call(&elsewhere);
+            CHECK(open_calls.size() == 1);
+            CHECK(outer->skipped_calls == 0);
+        }
+    }
+
+    TEST_CASE("async calls") {
+        const auto restore = gsl::finally([]() {
+            pending_async_calls.clear();
+            recorder::events.clear();
+        });
+        recorder::events.clear();
+        const function_call_event call{42, 0};
+        const auto returned = [](size_t i) -> const return_event & {
+            return static_cast<const return_event &>(*recorder::events.at(i));
+        };
+
+        SUBCASE("completing later") {
+            CHECK(async_returned(3, 7, &call));
+            async_status(3, 7);
+            CHECK(recorder::events.empty());
+            async_completed(7, true);
+            REQUIRE(recorder::events.size() == 1);
+            CHECK(returned(0).call == &call);
+            CHECK(returned(0).threw);
+            CHECK(pending_async_calls.empty());
+        }
+
+        SUBCASE("completed synchronously") {
+            CHECK(!async_returned(task_ran_to_completion, 8, &call));
+            REQUIRE(recorder::events.size() == 1);
+            CHECK(!returned(0).threw);
+            // the state machine got there first, and the call isn't recorded twice
+            async_completed(8, false);
+            CHECK(recorder::events.size() == 1);
+            CHECK(pending_async_calls.empty());
+        }
+
+        SUBCASE("completed while returning") {
+            CHECK(async_returned(3, 9, &call));
+            async_status(7, 9);
+            REQUIRE(recorder::events.size() == 1);
+            CHECK(returned(0).threw);
+            async_completed(9, true);
+            CHECK(recorder::events.size() == 1);
+            CHECK(pending_async_calls.empty());
+        }
+
+        SUBCASE("overlapping calls sharing a cached task") {
+            const function_call_event other{43, 0};
+            CHECK(async_returned(3, 10, &call));
+            CHECK(!async_returned(task_ran_to_completion, 1, &other));
+            CHECK(!async_returned(task_ran_to_completion, 1, &other));
+            CHECK(async_returned(3, 11, &other));
+            async_completed(11, false);
+            async_completed(10, true);
+            REQUIRE(recorder::events.size() == 4);
+            CHECK(returned(2).call == &other);
+            CHECK(!returned(2).threw);
+            CHECK(returned(3).call == &call);
+            CHECK(returned(3).threw);
+            CHECK(pending_async_calls.empty());
+        }
+
+        SUBCASE("of calls not recorded") {
+            async_completed(12, false);
+            CHECK(recorder::events.empty());
+            CHECK(pending_async_calls.empty());
+        }
+    }
+
+    // Called before a tail call, which replaces the frame of the method with the callee's.
+    void method_tail_called(const function_call_event *call)
+    {
+        recorder::leave_capture();
+        std::lock_guard lock(appmap::recorder::mutex);
+        spdlog::trace("{}({})", __FUNCTION__, call ? call->function : 0);
+        push_return(std::make_unique<return_event>(current_thread_id(), call));
+    }
+
+    // Classes of exceptions on their way out of recorded calls of the thread, seen by the filters
+    // around their bodies while looking for a handler, before their fault handlers run.
+    thread_local std::vector<std::pair<const function_call_event *, interned_string>> thrown_exceptions;
+
+    // Called from the filter around the method body, with the full name of the class of the exception,
+    // which doesn't get caught there.
+    void exception_thrown(const char16_t *chars, int32_t length, const function_call_event *call)
+    {
+        if (call && chars)
+            thrown_exceptions.emplace_back(call, utf16::to_utf8({chars, static_cast<size_t>(length)}));
+    }
+
+    // Called from the fault handler around the method body, when an exception propagates out of it.
+    void method_threw(const function_call_event *call)
+    {
+        recorder::leave_capture();
+        auto event = std::make_unique<return_event>(current_thread_id(), call);
+        event->threw = true;
+        const auto thrown = std::find_if(thrown_exceptions.begin(), thrown_exceptions.end(),
+            [call](const auto &e) { return e.first == call; });
+        if (thrown != thrown_exceptions.end()) {
+            event->exception_class = thrown->second;
+            thrown_exceptions.erase(thrown);
+        }
+
+        std::lock_guard lock(appmap::recorder::mutex);
+        push_return(std::move(event));
+    }
+
+    TEST_CASE("exception classes") {
+        const auto restore = gsl::finally([]() { recorder::events.clear(); });
+        recorder::events.clear();
+        const function_call_event outer{42, 0}, inner{42, 1}, unknown{42, 2};
+        const auto returned = [](size_t i) -> const return_event & {
+            return static_cast<const return_event &>(*recorder::events.at(i));
+        };
+
+        // filters see the exception from the innermost call out, before any fault handler runs
+        exception_thrown(u"System.ArgumentException", 24, &inner);
+        exception_thrown(u"System.ArgumentException", 24, &outer);
+        method_threw(&inner);
+        method_threw(&outer);
+        method_threw(&unknown);
+
+        REQUIRE(recorder::events.size() == 3);
+        CHECK(returned(0).exception_class == interned_string("System.ArgumentException"));
+        CHECK(returned(1).exception_class == interned_string("System.ArgumentException"));
+        CHECK(returned(2).threw);
+        CHECK(returned(2).exception_class == interned_string());
+        CHECK(thrown_exceptions.empty());
+    }
+
+    // Called from the catch handler around the captures of arguments, when capturing one throws,
+    // eg. in its ToString(). The call isn't recorded, and the thread is done capturing.
+    void capture_abandoned()
+    {
+        arguments.clear();
+        recorder::leave_capture();
     }
 
     template <typename T>
     void method_returned(T return_value, const function_call_event *call)
     {
+        recorder::leave_capture();
         std::lock_guard lock(appmap::recorder::mutex);
-        if (spdlog::get_level() >= spdlog::level::trace && call) {
+        if (spdlog::should_log(spdlog::level::trace) && call) {
             const auto &method_info = method_infos.at(call->function);
-            spdlog::trace("{}({}, {}.{})", __FUNCTION__, return_value, method_info.defined_class, method_info.method_id);
+            spdlog::trace("{}({}, {}.{})", __FUNCTION__, return_value, method_info.defined_class.str(), method_info.method_id.str());
+        }
+        push_return(std::make_unique<return_event>(current_thread_id(), call, return_value));
+    }
+
+    // Copies at most max_string_length code units of a pinned string,
+    // without splitting a surrogate pair.
+    cor_value string_value(const char16_t *chars, int32_t length)
+    {
+        const auto max_length = appmap::config::instance().max_string_length;
+
+        if (chars == nullptr)
+            return nullptr;
+        if (max_length > 0 && length > max_length) {
+            auto cut = max_length;
+            if (chars[cut - 1] >= 0xd800 && chars[cut - 1] <= 0xdbff)
+                cut--;
+            return truncated_string{std::u16string(chars, cut), length};
         }
-        recorder::events.push_back(std::make_unique<return_event>(current_thread_id(), call, return_value));
+        return std::u16string(chars, length);
     }
 
-    template <>
-    void method_returned<const char *>(const char *return_value, const function_call_event *call)
+    void method_returned_string(const char16_t *chars, int32_t length, const function_call_event *call)
     {
+        recorder::leave_capture();
         std::lock_guard lock(appmap::recorder::mutex);
-        if (spdlog::get_level() >= spdlog::level::trace && call) {
+        if (spdlog::should_log(spdlog::level::trace) && call) {
             const auto &method_info = method_infos.at(call->function);
-            if (return_value == nullptr)
-                spdlog::trace("{}({}, {}.{})", __FUNCTION__, "null", method_info.defined_class, method_info.method_id);
+            if (chars == nullptr)
+                spdlog::trace("{}({}, {}.{})", __FUNCTION__, "null", method_info.defined_class.str(), method_info.method_id.str());
             else
-                spdlog::trace("{}({}, {}.{})", __FUNCTION__, return_value, method_info.defined_class, method_info.method_id);
+                spdlog::trace("{}({}, {}.{})", __FUNCTION__, utf16::to_utf8({chars, static_cast<size_t>(length)}), method_info.defined_class.str(), method_info.method_id.str());
         }
-        if (return_value == nullptr)
-            recorder::events.push_back(std::make_unique<return_event>(current_thread_id(), call, nullptr));
-        else
-            recorder::events.push_back(std::make_unique<return_event>(current_thread_id(), call, std::string(return_value)));
+        push_return(std::make_unique<return_event>(current_thread_id(), call, string_value(chars, length)));
     }
 
     TEST_CASE("method_returned()")
     {
         recorder::events.clear();
         SUBCASE("with a string argument") {
-            method_returned("hello", nullptr);
-            CHECK((*recorder::events.back() == return_event{42, nullptr, std::string("hello")}));
+            method_returned_string(u"hello", 5, nullptr);
+            CHECK((*recorder::events.back() == return_event{42, nullptr, std::u16string(u"hello")}));
+        }
+
+        SUBCASE("with a long string argument") {
+            const std::u16string long_string(20000, u'a');
+            method_returned_string(long_string.data(), long_string.size(), nullptr);
+            CHECK((*recorder::events.back() == return_event{42, nullptr, truncated_string{std::u16string(10000, u'a'), 20000}}));
+        }
+
+        SUBCASE("with a surrogate pair at the cut") {
+            const auto long_string = std::u16string(9999, u'a') + u"\U0001F600" + std::u16string(100, u'a');
+            method_returned_string(long_string.data(), long_string.size(), nullptr);
+            CHECK((*recorder::events.back() == return_event{42, nullptr, truncated_string{std::u16string(9999, u'a'), 10101}}));
         }
 
         SUBCASE("with nullptr") {
-            method_returned<const char *>(nullptr, nullptr);
+            method_returned_string(nullptr, 0, nullptr);
             CHECK((*recorder::events.back() == return_event{42, nullptr, nullptr}));
         }
     }
 
-    clrie::instruction_factory::instruction_sequence make_return(const instrumentation &instr, uint64_t call_event_local, clrie::type return_type)
+    void method_returned_object_id(int32_t hash, const function_call_event *call)
+    {
+        recorder::leave_capture();
+        std::lock_guard lock(appmap::recorder::mutex);
+        if (spdlog::should_log(spdlog::level::trace) && call) {
+            const auto &method_info = method_infos.at(call->function);
+            spdlog::trace("{}({}, {}.{})", __FUNCTION__, hash, method_info.defined_class.str(), method_info.method_id.str());
+        }
+        // GetHashCode() of null is 0, and never 0 for an actual object
+        if (hash)
+            push_return(std::make_unique<return_event>(current_thread_id(), call, object_id{hash}));
+        else
+            push_return(std::make_unique<return_event>(current_thread_id(), call, nullptr));
+    }
+
+    // values of these types are captured directly, without calling ToString()
+    bool is_primitive(const clrie::type &type)
+    {
+        switch (type.cor_element_type()) {
+            case ELEMENT_TYPE_I1:
+            case ELEMENT_TYPE_I2:
+            case ELEMENT_TYPE_I4:
+            case ELEMENT_TYPE_I8:
+            case ELEMENT_TYPE_BOOLEAN:
+            case ELEMENT_TYPE_U1:
+            case ELEMENT_TYPE_U2:
+            case ELEMENT_TYPE_U4:
+            case ELEMENT_TYPE_U8:
+            case ELEMENT_TYPE_STRING:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Copies at most max_collection_elements leading elements of a pinned array.
+    template <typename T>
+    cor_value array_value(int32_t length, const T *data)
+    {
+        const auto max_elements = appmap::config::instance().max_collection_elements;
+
+        if (length < 0)
+            return nullptr;
+
+        collection result{length};
+        const auto count = std::min(length, max_elements);
+        result.elements.reserve(count);
+        for (int32_t i = 0; i < count; i++) {
+            if constexpr (std::is_same_v<T, bool>)
+                result.elements.push_back(reinterpret_cast<const uint8_t *>(data)[i] != 0);
+            else if constexpr (std::is_signed_v<T>)
+                result.elements.push_back(static_cast<int64_t>(data[i]));
+            else
+                result.elements.push_back(static_cast<uint64_t>(data[i]));
+        }
+        return result;
+    }
+
+    cor_value count_value(int32_t count)
+    {
+        if (count < 0)
+            return nullptr;
+        return collection{count};
+    }
+
+    template <typename T>
+    void capture_array(int32_t length, const T *data)
+    {
+        spdlog::trace("captured array of length {}", length);
+        arguments.push_back(array_value(length, data));
+    }
+
+    void capture_count(int32_t count)
+    {
+        spdlog::trace("captured collection of size {}", count);
+        arguments.push_back(count_value(count));
+    }
+
+    template <typename T>
+    void method_returned_array(int32_t length, const T *data, const function_call_event *call)
+    {
+        recorder::leave_capture();
+        std::lock_guard lock(appmap::recorder::mutex);
+        push_return(std::make_unique<return_event>(current_thread_id(), call, array_value(length, data)));
+    }
+
+    void method_returned_count(int32_t count, const function_call_event *call)
+    {
+        recorder::leave_capture();
+        std::lock_guard lock(appmap::recorder::mutex);
+        push_return(std::make_unique<return_event>(current_thread_id(), call, count_value(count)));
+    }
+
+    TEST_CASE("collection capture")
     {
-        const auto cor_type = return_type.cor_element_type();
+        recorder::events.clear();
+        SUBCASE("with a short array") {
+            const int32_t values[] = { 1, -2, 3 };
+            method_returned_array(3, values, nullptr);
+            CHECK((*recorder::events.back() == return_event{42, nullptr, collection{3, {int64_t{1}, int64_t{-2}, int64_t{3}}}}));
+        }
+
+        SUBCASE("with a long array") {
+            const std::vector<uint8_t> values(1000, 7);
+            method_returned_array(values.size(), values.data(), nullptr);
+            CHECK((*recorder::events.back() == return_event{42, nullptr, collection{1000, std::vector<std::variant<int64_t, uint64_t, bool>>(10, uint64_t{7})}}));
+        }
 
+        SUBCASE("with an empty array") {
+            method_returned_array<bool>(0, nullptr, nullptr);
+            CHECK((*recorder::events.back() == return_event{42, nullptr, collection{0}}));
+        }
+
+        SUBCASE("with a null array") {
+            method_returned_array<int64_t>(-1, nullptr, nullptr);
+            CHECK((*recorder::events.back() == return_event{42, nullptr, nullptr}));
+        }
+
+        SUBCASE("with a collection") {
+            method_returned_count(12345, nullptr);
+            CHECK((*recorder::events.back() == return_event{42, nullptr, collection{12345}}));
+        }
+    }
+
+    // Calls f with a value of the C++ type matching a primitive array element type.
+    template <typename F>
+    bool with_element_type(CorElementType type, F f)
+    {
+        switch (type) {
+            case ELEMENT_TYPE_I1: f(int8_t{}); return true;
+            case ELEMENT_TYPE_I2: f(int16_t{}); return true;
+            case ELEMENT_TYPE_I4: f(int32_t{}); return true;
+            case ELEMENT_TYPE_I8: f(int64_t{}); return true;
+            case ELEMENT_TYPE_U1: f(uint8_t{}); return true;
+            case ELEMENT_TYPE_U2: f(uint16_t{}); return true;
+            case ELEMENT_TYPE_U4: f(uint32_t{}); return true;
+            case ELEMENT_TYPE_U8: f(uint64_t{}); return true;
+            case ELEMENT_TYPE_BOOLEAN: f(bool{}); return true;
+            default: return false;
+        }
+    }
+
+    // Emits capture of the array or collection on the stack as its size and (for primitive arrays)
+    // leading elements; probe(capture, returned) emits the call to whichever native probe applies.
+    // Objects that aren't a collection are left on the stack and branch to not_collection.
+    template <typename Probe>
+    clrie::instruction_factory::instruction_sequence capture_collection(const instrumentation &instr, const clrie::type &type, const clrie::instruction_factory::instruction &not_collection, Probe probe)
+    {
         clrie::instruction_factory::instruction_sequence seq;
-        if (cor_type != ELEMENT_TYPE_VOID) {
-            seq += instr.create_instruction(Cee_Dup);
-            seq += instr.capture_value(return_type);
+
+        if (type.cor_element_type() == ELEMENT_TYPE_SZARRAY) {
+            const clrie::type element = type.as<ICompositeType>().get(&ICompositeType::GetRelatedType);
+            const bool primitive = with_element_type(element.cor_element_type(), [&](auto tag) {
+                using T = decltype(tag);
+                seq += instr.pin_array(element);
+                seq += probe(capture_array<T>, method_returned_array<T>);
+                seq += instr.unpin_array(element);
+            });
+            if (primitive)
+                return seq;
         }
 
+        seq += instr.collection_count(type, not_collection);
+        seq += probe(capture_count, method_returned_count);
+        return seq;
+    }
+
+    clrie::instruction_factory::instruction_sequence make_return(const instrumentation &instr, uint64_t call_event_local, clrie::type return_type, capture_policy policy)
+    {
+        clrie::instruction_factory::instruction_sequence seq;
+
+        // no call event means the call was made by the recorder and isn't recorded
+        const auto done = instr.create_instruction(Cee_Nop);
         seq += instr.create_load_local_instruction(call_event_local);
+        seq += instr.create_branch_instruction(Cee_Brfalse, done);
 
-        switch (cor_type) {
-            case ELEMENT_TYPE_VOID:
-                seq += instr.make_call(method_returned_void);
-                break;
+        if (return_type.cor_element_type() == ELEMENT_TYPE_VOID
+            || policy == capture_policy::none
+            || policy == capture_policy::type_only)
+        {
+            seq += instr.create_load_local_instruction(call_event_local);
+            seq += instr.make_call(method_returned_void);
+            seq += done;
+            return seq;
+        }
+
+        seq += instr.create_instruction(Cee_Dup);
+
+        if (policy == capture_policy::identity) {
+            seq += instr.create_call_to_get_hash_code();
+            seq += instr.create_load_local_instruction(call_event_local);
+            seq += instr.make_call(method_returned_object_id);
+            seq += done;
+            return seq;
+        }
+
+        // ToString() might call back into instrumented code; the returned probe leaves capture
+        if (!is_primitive(return_type)) {
+            seq += instr.make_call(recorder::enter_capture);
+            seq += instr.create_instruction(Cee_Pop);
+        }
+
+        if (instr.may_be_collection(return_type)) {
+            const auto not_collection = instr.create_instruction(Cee_Nop);
+            seq += capture_collection(instr, return_type, not_collection, [&](auto, auto fn) {
+                clrie::instruction_factory::instruction_sequence call;
+                call += instr.create_load_local_instruction(call_event_local);
+                call += instr.make_call(fn);
+                return call;
+            });
+            // arrays are always captured as collections
+            if (return_type.cor_element_type() == ELEMENT_TYPE_SZARRAY) {
+                seq += done;
+                return seq;
+            }
+            seq += instr.create_branch_instruction(Cee_Br, done);
+            seq += not_collection;
+        }
+
+        seq += instr.capture_value(return_type);
+
+        const auto returned = [&](auto fn) {
+            seq += instr.create_load_local_instruction(call_event_local);
+            seq += instr.make_call(fn);
+        };
 
+        switch (return_type.cor_element_type()) {
             case ELEMENT_TYPE_I1:
             case ELEMENT_TYPE_I2:
             case ELEMENT_TYPE_I4:
             case ELEMENT_TYPE_I8:
-                seq += instr.make_call(method_returned<int64_t>);
+                returned(method_returned<int64_t>);
                 break;
 
             case ELEMENT_TYPE_BOOLEAN:
-                seq += instr.make_call(method_returned<bool>);
+                returned(method_returned<bool>);
                 break;
 
             case ELEMENT_TYPE_U1:
             case ELEMENT_TYPE_U2:
             case ELEMENT_TYPE_U4:
             case ELEMENT_TYPE_U8:
-                seq += instr.make_call(method_returned<uint64_t>);
+                returned(method_returned<uint64_t>);
                 break;
 
             default:
-                seq += instr.make_call(method_returned<const char *>);
+                seq += instr.pin_string();
+                returned(method_returned_string);
+                seq += instr.unpin_string();
                 break;
         }
 
+        seq += done;
         return seq;
     }
 
@@ -133,19 +769,47 @@ namespace {
         arguments.push_back(value);
     }
 
-    template <>
-    void capture_argument<const char *>(const char *value)
+    void capture_string(const char16_t *chars, int32_t length)
     {
-        spdlog::trace("captured string {}", value);
-        if (value)
-            arguments.push_back(std::string(value));
+        if (spdlog::should_log(spdlog::level::trace))
+            spdlog::trace("captured string {}", chars ? utf16::to_utf8({chars, static_cast<size_t>(length)}) : "null");
+        arguments.push_back(string_value(chars, length));
+    }
+
+    void capture_object_id(int32_t hash)
+    {
+        spdlog::trace("captured object id {}", hash);
+        // GetHashCode() of null is 0, and never 0 for an actual object
+        if (hash)
+            arguments.push_back(object_id{hash});
         else
             arguments.push_back(nullptr);
     }
 
+    clrie::instruction_factory::instruction_sequence capture_identity(const instrumentation &instr)
+    {
+        clrie::instruction_factory::instruction_sequence seq;
+        seq += instr.create_call_to_get_hash_code();
+        seq += instr.make_call(capture_object_id);
+        return seq;
+    }
+
     clrie::instruction_factory::instruction_sequence capture_argument(const instrumentation &instr, clrie::type type)
     {
         clrie::instruction_factory::instruction_sequence seq;
+        const auto done = instr.create_instruction(Cee_Nop);
+
+        if (instr.may_be_collection(type)) {
+            const auto not_collection = instr.create_instruction(Cee_Nop);
+            seq += capture_collection(instr, type, not_collection, [&](auto fn, auto) {
+                return instr.make_call(fn);
+            });
+            // arrays are always captured as collections
+            if (type.cor_element_type() == ELEMENT_TYPE_SZARRAY)
+                return seq;
+            seq += instr.create_branch_instruction(Cee_Br, done);
+            seq += not_collection;
+        }
 
         seq += instr.capture_value(type);
 
@@ -172,20 +836,55 @@ namespace {
                 break;
 
             default:
-                seq += instr.make_call(capture_argument<const char *>);
+                seq += instr.pin_string();
+                seq += instr.make_call(capture_string);
+                seq += instr.unpin_string();
                 break;
         }
 
+        seq += done;
         return seq;
     }
 
-    bool is_tail(com::ptr<IInstruction> inst) {
+    // Narrows a configured policy down to one that can be applied to a value of the type.
+    capture_policy applicable(capture_policy policy, const clrie::type &type)
+    {
+        switch (policy) {
+            case capture_policy::primitive_only:
+                return is_primitive(type) ? capture_policy::tostring : capture_policy::type_only;
+
+            case capture_policy::identity:
+                if (is_primitive(type))
+                    return capture_policy::tostring;
+                // value types have no identity to speak of
+                return instrumentation::is_reference_type(type) ? capture_policy::identity : capture_policy::type_only;
+
+            default:
+                return policy;
+        }
+    }
+
+    // Emits code capturing the value on top of the stack according to the policy.
+    clrie::instruction_factory::instruction_sequence capture_argument(const instrumentation &instr, clrie::type type, capture_policy policy)
+    {
+        if (policy == capture_policy::identity)
+            return capture_identity(instr);
+        else
+            return capture_argument(instr, type);
+    }
+
+    // The tail. prefix of the call whose result the ret returns, if there is one.
+    com::ptr<IInstruction> tail_prefix(com::ptr<IInstruction> ret) {
         try {
-            com::ptr<IInstruction> prev = inst.get(&IInstruction::GetPreviousInstruction);
-            return prev.get(&IInstruction::GetOpCode) == Cee_Tailcall;
+            com::ptr<IInstruction> prev = ret.get(&IInstruction::GetPreviousInstruction);
+            for (int i = 0; i < 2; i++) {
+                if (prev.get(&IInstruction::GetOpCode) == Cee_Tailcall)
+                    return prev;
+                prev = prev.get(&IInstruction::GetPreviousInstruction);
+            }
         } catch (const std::system_error &) {
-            return false;
         }
+        return nullptr;
     }
 
     // TODO: DRY up with instrumentation.cpp
@@ -210,76 +909,639 @@ namespace {
 
         while (metadata->EnumParams(&it, token, &param, 1, nullptr) == S_OK) {
             char16_t name[256];
-            com::hresult::check(metadata->GetParamProps(param, nullptr, nullptr, name, 256, nullptr, nullptr, nullptr, nullptr, nullptr));
-            names.push_back(utf8::utf16to8(std::u16string(name)));
+            ULONG length;
+            com::hresult::check(metadata->GetParamProps(param, nullptr, nullptr, name, 256, &length, nullptr, nullptr, nullptr, nullptr));
+            if (length <= 256) {
+                names.push_back(utf8::utf16to8(std::u16string(name)));
+                continue;
+            }
+
+            std::u16string long_name(length, u'\0');
+            com::hresult::check(metadata->GetParamProps(param, nullptr, nullptr, long_name.data(), length, nullptr, nullptr, nullptr, nullptr, nullptr));
+            long_name.resize(length - 1);  // including the terminator
+            names.push_back(utf8::utf16to8(long_name));
         }
 
         return names;
     }
 }
 
-void recorder::instrument(clrie::method_info method)
+void recorder::record(std::unique_ptr<event> event)
+{
+    std::lock_guard lock(mutex);
+    commit_staged();
+    events.push_back(std::move(event));
+}
+
+TEST_CASE("minimum duration") {
+    auto &config = config::instance();
+    const auto restore = gsl::finally([&config]() {
+        config.min_duration = {};
+        staged_calls.clear();
+        recorder::events.clear();
+    });
+    config.min_duration = std::chrono::seconds(1);
+    recorder::events.clear();
+    const auto fun = method_infos.push_back({"Some.Class", "Outer", true, "System.Void"});
+    const auto other = method_infos.push_back({"Some.Class", "Inner", true, "System.Void"});
+    const auto call = [](size_t id) {
+        return static_cast<const function_call_event *>(method_called(id));
+    };
+    const auto slow_down = [](const function_call_event *call) {
+        const_cast<function_call_event *>(call)->time -= std::chrono::seconds(10);
+    };
+
+    SUBCASE("fast calls are dropped") {
+        const auto outer = call(fun);
+        method_returned_void(call(other));
+        CHECK(recorder::events.empty());
+        method_returned_void(outer);
+        CHECK(recorder::events.empty());
+        CHECK(staged_calls.empty());
+    }
+
+    SUBCASE("slow calls are kept with their callers") {
+        const auto outer = call(fun);
+        method_returned_void(call(other));
+        const auto slow = call(other);
+        slow_down(slow);
+        method_returned_void(slow);
+        REQUIRE(recorder::events.size() == 3);
+        CHECK(recorder::events[0].get() == outer);
+        CHECK(recorder::events[1].get() == slow);
+        // committed, so kept however long it took
+        method_returned_void(outer);
+        CHECK(recorder::events.size() == 4);
+    }
+
+    SUBCASE("calls left open are dropped") {
+        const auto outer = call(fun);
+        call(other);
+        slow_down(outer);
+        method_returned_void(outer);
+        REQUIRE(recorder::events.size() == 2);
+        CHECK(recorder::events[0].get() == outer);
+    }
+
+    SUBCASE("kept events") {
+        const auto outer = call(fun);
+        recorder::record(std::make_unique<http_request_event>(42, "GET", "/"));
+        REQUIRE(recorder::events.size() == 2);
+        CHECK(recorder::events[0].get() == outer);
+    }
+}
+
+
+namespace {
+    // The builder of the task of an async Task method, as a field of its state machine.
+    struct task_builder {
+        mdTypeDef state_machine;
+        mdFieldDef field;
+        mdTypeRef type;  // AsyncTaskMethodBuilder or AsyncTaskMethodBuilder`1
+        bool generic;
+        std::vector<COR_SIGNATURE> field_type;
+    };
+
+    // Finds the task builder of the state machine of an async Task method.
+    // Those are recognized by metadata only: a field named as the compiler names the builder,
+    // of one of the builder types.
+    std::optional<task_builder> find_task_builder(const com::ptr<IMetaDataImport> &md, mdTypeDef state_machine)
+    {
+        mdFieldDef field;
+        PCCOR_SIGNATURE sig;
+        ULONG sig_length;
+        if (md->FindField(state_machine, u"<>t__builder", nullptr, 0, &field) != S_OK
+            || md->GetFieldProps(field, nullptr, nullptr, 0, nullptr, nullptr, &sig, &sig_length, nullptr, nullptr, nullptr) != S_OK
+            || sig_length < 3 || sig[0] != IMAGE_CEE_CS_CALLCONV_FIELD)
+            return std::nullopt;
+
+        auto p = sig + 1;
+        const bool generic = *p == ELEMENT_TYPE_GENERICINST;
+        if (generic)
+            p++;
+        if (*p++ != ELEMENT_TYPE_VALUETYPE)
+            return std::nullopt;
+
+        const mdToken type = CorSigUncompressToken(p);
+        char16_t name[256];
+        if (TypeFromToken(type) != mdtTypeRef
+            || md->GetTypeRefProps(type, nullptr, name, 256, nullptr) != S_OK
+            || std::u16string_view(name) != (generic
+                ? u"System.Runtime.CompilerServices.AsyncTaskMethodBuilder`1"
+                : u"System.Runtime.CompilerServices.AsyncTaskMethodBuilder"))
+            return std::nullopt;
+
+        return task_builder{state_machine, field, type, generic, {sig + 1, sig + sig_length}};
+    }
+
+    // The task builder if the method is MoveNext of the state machine of an async Task method.
+    std::optional<task_builder> find_task_builder(const clrie::method_info &method)
+    {
+        if (method.name() != "MoveNext")
+            return std::nullopt;
+
+        const auto md = method.module_info().meta_data_import();
+        mdTypeDef state_machine;
+        if (md->GetMethodProps(method.method_token(), &state_machine, nullptr, 0, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr) != S_OK)
+            return std::nullopt;
+        return find_task_builder(md, state_machine);
+    }
+
+    // The stub of an async Task method only starts its state machine and returns the task.
+    // Returns MoveNext of the state machine, named by the AsyncStateMachineAttribute of the stub,
+    // if it has a task builder to follow.
+    std::optional<mdMethodDef> find_state_machine(const clrie::method_info &method, const clrie::type &return_type)
+    {
+        // Task<T> is a generic instantiation, named by its generic type
+        switch (return_type.cor_element_type()) {
+            case ELEMENT_TYPE_CLASS:
+                if (return_type.name() != "System.Threading.Tasks.Task")
+                    return std::nullopt;
+                break;
+            case ELEMENT_TYPE_GENERICINST: {
+                const clrie::type generic = return_type.as<ICompositeType>().get(&ICompositeType::GetRelatedType);
+                if (generic.name() != "System.Threading.Tasks.Task`1")
+                    return std::nullopt;
+                break;
+            }
+            default:
+                return std::nullopt;
+        }
+
+        // the attribute blob is a prolog, the serialized name of the type, and no named arguments
+        const auto md = method.module_info().meta_data_import();
+        const uint8_t *blob;
+        ULONG size;
+        if (md->GetCustomAttributeByName(method.method_token(), u"System.Runtime.CompilerServices.AsyncStateMachineAttribute",
+                reinterpret_cast<const void **>(&blob), &size) != S_OK
+            || size < 3 || blob[0] != 1 || blob[1] != 0)
+            return std::nullopt;
+
+        ULONG length;
+        const auto length_size = CorSigUncompressData(blob + 2, &length);
+        if (length_size == static_cast<ULONG>(-1) || 2 + length_size + length > size)
+            return std::nullopt;
+        const std::string_view name(reinterpret_cast<const char *>(blob + 2 + length_size), length);
+        // the compiler doesn't name state machines with anything escaped or assembly-qualified
+        if (name.find_first_of("\\,[]") != std::string_view::npos)
+            return std::nullopt;
+
+        // nested types are separated by +, and looked up in their enclosing type
+        mdTypeDef state_machine = mdTokenNil;
+        for (size_t start = 0; start <= name.size();) {
+            const auto end = std::min(name.find('+', start), name.size());
+            if (md->FindTypeDefByName(utf8::utf8to16(std::string(name.substr(start, end - start))).c_str(), state_machine, &state_machine) != S_OK)
+                return std::nullopt;
+            start = end + 1;
+        }
+
+        mdMethodDef move_next;
+        if (!find_task_builder(md, state_machine)
+            || md->FindMethod(state_machine, u"MoveNext", nullptr, 0, &move_next) != S_OK)
+            return std::nullopt;
+        return move_next;
+    }
+
+    // Number of generic parameters of the type definition, 0 if it isn't generic.
+    ULONG generic_param_count(const com::ptr<IMetaDataImport> &md, mdTypeDef type)
+    {
+        const auto md2 = md.as<IMetaDataImport2>();
+        HCORENUM it = nullptr;
+        scope_guard closer{ [&]() { if (it) md2->CloseEnum(it); } };
+        mdGenericParam param;
+        ULONG count = 0;
+        while (md2->EnumGenericParams(&it, type, &param, 1, nullptr) == S_OK)
+            count++;
+        return count;
+    }
+
+    // Instead of being recorded itself, the state machine of an async method, which can run
+    // many times on different threads, records when its task is completed, which is when
+    // the call of the async method returns. It tells the task apart by its id.
+    void fold_state_machine(clrie::instruction_graph &code, const instrumentation &instr, const task_builder &builder)
+    {
+        using namespace cil::ops;
+        const auto md = instr.module().meta_data_import();
+
+        // The state machine of a generic async method, or of one in a generic class, is generic too,
+        // and its own code refers to its builder through its instantiation over its own parameters.
+        mdToken builder_field = builder.field;
+        if (const auto arity = generic_param_count(md, builder.state_machine)) {
+            mdToken extends;
+            char16_t base[32] = {};
+            com::hresult::check(md->GetTypeDefProps(builder.state_machine, nullptr, 0, nullptr, nullptr, &extends));
+            const bool is_struct = TypeFromToken(extends) == mdtTypeRef
+                && md->GetTypeRefProps(extends, nullptr, base, 32, nullptr) == S_OK
+                && std::u16string_view(base) == u"System.ValueType";
+
+            signature::signature self = { ELEMENT_TYPE_GENERICINST, static_cast<COR_SIGNATURE>(is_struct ? ELEMENT_TYPE_VALUETYPE : ELEMENT_TYPE_CLASS) };
+            COR_SIGNATURE compressed[4];
+            self.insert(self.end(), compressed, compressed + CorSigCompressToken(builder.state_machine, compressed));
+            self.insert(self.end(), compressed, compressed + CorSigCompressData(arity, compressed));
+            for (ULONG i = 0; i < arity; i++) {
+                self.push_back(ELEMENT_TYPE_VAR);
+                self.insert(self.end(), compressed, compressed + CorSigCompressData(i, compressed));
+            }
+
+            signature::signature field = { IMAGE_CEE_CS_CALLCONV_FIELD };
+            field.insert(field.end(), builder.field_type.begin(), builder.field_type.end());
+            builder_field = instr.member_reference(instr.type_token(self), u"<>t__builder", field);
+        }
+
+        // Task lives where the builder does
+        mdToken scope;
+        com::hresult::check(md->GetTypeRefProps(builder.type, &scope, nullptr, 0, nullptr));
+        const auto get_task_sig = builder.generic
+            ? signature::method(signature::generic(instr.type_reference(scope, u"System.Threading.Tasks.Task`1"),
+                { signature::signature{ELEMENT_TYPE_VAR, 0} }), {})
+            : signature::method(instr.type_reference(scope, u"System.Threading.Tasks.Task"), {});
+
+        for (auto it = code.first_instruction(); it; ++it) {
+            if (it.get(&IInstruction::GetOpCode) != Cee_Call)
+                continue;
+
+            mdToken callee;
+            com::hresult::check(it.as<IOperandInstruction>()->GetOperandValue(sizeof(callee), reinterpret_cast<BYTE *>(&callee)));
+            mdToken parent;
+            char16_t name[32];
+            if (TypeFromToken(callee) != mdtMemberRef
+                || md->GetMemberRefProps(callee, &parent, name, 32, nullptr, nullptr, nullptr) != S_OK)
+                continue;
+
+            const std::u16string_view method_name(name);
+            if (method_name != u"SetResult" && method_name != u"SetException")
+                continue;
+
+            if (builder.generic) {
+                PCCOR_SIGNATURE spec;
+                ULONG spec_length;
+                if (TypeFromToken(parent) != mdtTypeSpec
+                    || md->GetTypeSpecFromToken(parent, &spec, &spec_length) != S_OK
+                    || !std::equal(spec, spec + spec_length, builder.field_type.begin(), builder.field_type.end()))
+                    continue;
+            } else if (parent != builder.type) {
+                continue;
+            }
+
+            const auto completed = cil::compile({
+                ldarg{0},
+                ldflda{builder_field},
+                call{instr.member_reference(parent, u"get_Task", get_task_sig)},
+                instr.call_task_id(),
+                ldc_i4{method_name == u"SetException"},
+                ldc{async_completed},
+                calli{instr.native_type(async_completed)}
+            }, instr);
+
+            clrie::instruction_graph::iterator pos = it;
+            for (const auto &ins: completed) {
+                code.insert_after(pos, ins);
+                pos = ins;
+            }
+            it = pos;
+        }
+    }
+}
+
+void recorder::instrument(clrie::method_info method, const module_plan *plan)
 {
     clrie::instruction_graph code = method.instructions();
     instrumentation instr(method);
 
+    if (const auto builder = find_task_builder(method)) {
+        fold_state_machine(code, instr, *builder);
+        return;
+    }
+
     auto return_type = method.return_type();
     const auto is_static = method.is_static() || method.is_static_constructor();
     const auto call_event_local = instr.add_local<function_call_event *>();
 
-    auto ins = code.first_instruction();
-
     const auto parameters = method.parameters();
+    std::vector<clrie::type> parameter_types;
+    parameter_types.reserve(parameters.size());
+    for (auto &p: parameters)
+        parameter_types.push_back(p.get(&IMethodParameter::GetType));
+
+    // names are expensive to look up, so they're kept in the plan cache,
+    // for every generic instantiation and rejit of the method, and across runs
+    const auto token = method.method_token();
+    auto names = plan ? plan->names(token) : std::nullopt;
+    if (!names) {
+        const auto type_names = plan ? &plan->type_names : nullptr;
+        names = method_names{
+            friendly_name(method.declaring_type(), type_names),
+            {},
+            param_names(method),
+            friendly_name(return_type, type_names)
+        };
+        for (const auto &type: parameter_types)
+            names->parameter_types.push_back(friendly_name(type, type_names));
+        if (plan)
+            plan->add_names(token, *names);
+    }
+    spdlog::trace("param names: {}", names->parameter_names);
+    assert(names->parameter_names.size() >= parameter_types.size());
+
     std::vector<parameter_info> parameter_infos;
-    parameter_infos.reserve(parameters.size());
-    const auto names = param_names(method);
-    spdlog::trace("param names: {}", names);
-    auto names_it = names.begin();
+    parameter_infos.reserve(parameters.size() + 1);
 
     uint idx = 0;
 
+    struct argument_capture {
+        uint arg;
+        clrie::type type;
+        capture_policy policy;
+    };
+    std::vector<argument_capture> captures;
+
+    const auto &config = appmap::config::instance();
+    const auto &defined_class = names->defined_class;
+
     if (!is_static) {
         const auto &type = method.declaring_type();
-        parameter_infos.push_back({friendly_name(method.declaring_type()), "this"});
-        code.insert_before(ins, instr.create_load_arg_instruction(idx++));
-        code.insert_before(ins, capture_argument(instr, type));
-    }
+        parameter_info receiver{defined_class, "this"};
+        const auto policy = applicable(config.receiver_capture(defined_class), type);
+
+        if (policy == capture_policy::type_only)
+            receiver.captured = false;
+        else
+            captures.push_back({idx, type, policy});
 
-    for (auto &p: parameters) {
-        const clrie::type type = p.get(&IMethodParameter::GetType);
-        assert(names_it != names.end());
-        parameter_infos.push_back({friendly_name(type), *(names_it++)});
-        code.insert_before(ins, instr.create_load_arg_instruction(idx++));
-        code.insert_before(ins, capture_argument(instr, type));
+        idx++;
+        parameter_infos.push_back(std::move(receiver));
     }
 
-    // prologue
-    code.insert_before(ins, instr.load_constants(method_infos.size()));
-    code.insert_before(ins, instr.make_call(&method_called));
-    code.insert_before(ins, instr.create_store_local_instruction(call_event_local));
+    for (size_t i = 0; i < parameter_types.size(); i++) {
+        const auto &type = parameter_types[i];
+        parameter_info info{names->parameter_types[i], names->parameter_names[i]};
+        const auto arg = idx++;
 
-    // Look for returns and insert epilogue gadget before each.
-    // (Note we could instead transfrom the method to have a single return point
-    // at the end and insert one epilogue there.
-    // This is what CLRIE's SingleRetDefaultInstrumentation is supposed to do,
-    // but it's buggy and produces broken code in some cases.)
-    while (++ins) {
-        com::ptr<IInstruction> next;
-        if (ins.get(&IInstruction::GetOpCode) == Cee_Ret) {
-            if (is_tail(ins)) {
-                spdlog::warn("Tail call detected in {} -- tail calls aren't fully supported yet, so your appmap might be incorrect.\n\tPlease report at https://github.com/applandinc/appmap-dotnet/issues", method.full_name());
-                ins = ins.get(&IInstruction::GetPreviousInstruction);
-            }
+        switch (const auto policy = applicable(config.value_capture(defined_class, names->parameter_types[i]), type)) {
+            case capture_policy::none:
+                continue;
 
-            code.insert_before_and_retarget_offsets(ins, make_return(instr, call_event_local, return_type));
+            case capture_policy::type_only:
+                info.captured = false;
+                break;
+
+            default:
+                captures.push_back({arg, type, policy});
         }
+
+        parameter_infos.push_back(std::move(info));
     }
 
-    method_infos.push_back({
-        method.declaring_type().name(),
+    const auto &return_class = names->return_type;
+    // The call of an async method returns when its task completes, not when it returns the task,
+    // which the state machine reports, so that gets instrumented whatever the filters say.
+    // Without a plan to tell that to, the call returns with the task like any other.
+    bool async = false;
+    if (plan)
+        if (const auto state_machine = find_state_machine(method, return_type)) {
+            plan->folded_state_machines.insert_or_assign(*state_machine, true);
+            async = true;
+        }
+    const auto return_policy = async
+        ? capture_policy::type_only
+        : applicable(config.value_capture(defined_class, return_class), return_type);
+
+    const auto id = method_infos.push_back({
+        defined_class,
         method.name(),
         is_static,
-        friendly_name(return_type),
-        std::move(parameter_infos)
+        return_class,
+        std::move(parameter_infos),
+        return_policy == capture_policy::type_only
     });
+
+    // marks the start of the original body, which can then be branched to from the prologue
+    // and become the start of a protected block, even if it starts with a ret that gets replaced
+    const auto body = instr.create_instruction(Cee_Nop);
+    code.insert_before(code.first_instruction(), body);
+    const clrie::instruction_graph::iterator ins = body;
+    std::function<clrie::instruction_factory::instruction_sequence()> epilogue;
+
+    // Capturing values with ToString() can throw, which would leave the thread capturing
+    // and throw at the app, so where that can happen it's protected by catch handlers.
+    // The argument captures end before the original body, so that's done in constructors too,
+    // but not the body itself, as the runtime doesn't expect the base constructor call to be protected.
+    const bool is_constructor = method.is_constructor() || method.is_static_constructor();
+    std::optional<std::pair<com::ptr<IInstruction>, com::ptr<IInstruction>>> captures_block;
+
+    // Calls made while the recorder is capturing values, or beyond the depth limits,
+    // skip straight to the original code.
+    code.insert_before(ins, instr.load_constants(int64_t{0}));
+    code.insert_before(ins, instr.create_store_local_instruction(call_event_local));
+    if (limits_depth(config)) {
+        code.insert_before(ins, instr.load_constants(id));
+        code.insert_before(ins, instr.make_call(enter_call));
+    } else {
+        code.insert_before(ins, instr.make_call(recorder::enter_capture));
+    }
+    code.insert_before(ins, instr.create_branch_instruction(Cee_Brtrue, ins));
+
+    if (!captures.empty()) {
+        captures_block.emplace(instr.create_instruction(Cee_Nop), nullptr);
+        code.insert_before(ins, captures_block->first);
+    }
+
+    for (auto &capture: captures) {
+        code.insert_before(ins, instr.create_load_arg_instruction(capture.arg));
+        code.insert_before(ins, capture_argument(instr, capture.type, capture.policy));
+    }
+
+    code.insert_before(ins, instr.load_constants(id));
+    code.insert_before(ins, instr.make_call(&method_called));
+    code.insert_before(ins, instr.create_store_local_instruction(call_event_local));
+
+    if (captures_block) {
+        captures_block->second = instr.create_branch_instruction(Cee_Leave, ins);
+        code.insert_before(ins, captures_block->second);
+    }
+
+    epilogue = [&]() { return make_return(instr, call_event_local, return_type, return_policy); };
+    const bool protect_epilogue = !async && !is_constructor && return_type.cor_element_type() != ELEMENT_TYPE_VOID;
+
+    // Every return jumps to a single exit at the end of the method, with the return value
+    // kept in a local, so that there's only one epilogue however many returns there are.
+    // (CLRIE's SingleRetDefaultInstrumentation is supposed to do this, but it's buggy
+    // and produces broken code in some cases.)
+    const auto exit = instr.create_instruction(Cee_Nop);
+    std::optional<uint64_t> result_local;
+    if (return_type.cor_element_type() != ELEMENT_TYPE_VOID)
+        result_local = instr.add_local(return_type);
+
+    if (async) {
+        // The task is told apart by its id, and whether it has completed by its status,
+        // which is read again once the call is left pending, in case it has just completed.
+        epilogue = [&]() {
+            using namespace cil::ops;
+            const auto event = static_cast<int>(call_event_local);
+            const auto task = static_cast<int>(*result_local);
+            return cil::compile({
+                ldloc{event}, brfalse{0},
+                ldloc{task}, instr.call_task_status(),
+                ldloc{task}, instr.call_task_id(),
+                ldloc{event},
+                ldc{async_returned},
+                calli{instr.native_type(async_returned)},
+                brfalse{0},
+                ldloc{task}, instr.call_task_status(),
+                ldloc{task}, instr.call_task_id(),
+                ldc{async_status},
+                calli{instr.native_type(async_status)},
+                label{0}
+            }, instr);
+        };
+    }
+
+    // The body is also wrapped in a fault block recording exceptional exits, unless it has
+    // instructions that can't be in a protected block. Constructors are left alone too.
+    bool protectable = !is_constructor;
+    bool returns = false;
+
+    for (auto it = ins; it;) {
+        auto next = it;
+        ++next;
+
+        switch (it.get(&IInstruction::GetOpCode)) {
+            case Cee_Ret:
+                if (const auto prefix = tail_prefix(it)) {
+                    // The tail call stays, so that deep recursion doesn't grow the stack,
+                    // and the call is recorded as returned just before it replaces the frame.
+                    // The callee's events then follow as a sibling instead of a child.
+                    const auto done = instr.create_instruction(Cee_Nop);
+                    clrie::instruction_factory::instruction_sequence marker = {
+                        instr.create_load_local_instruction(call_event_local),
+                        instr.create_branch_instruction(Cee_Brfalse, done),
+                        instr.create_load_local_instruction(call_event_local)
+                    };
+                    marker += instr.make_call(method_tail_called);
+                    marker += done;
+                    code.insert_before_and_retarget_offsets(prefix, marker);
+                    // a tail call can't be made from a protected block
+                    protectable = false;
+                } else {
+                    clrie::instruction_factory::instruction_sequence leave;
+                    if (result_local)
+                        leave += instr.create_store_local_instruction(*result_local);
+                    leave += instr.create_branch_instruction(Cee_Leave, exit);
+                    code.insert_before_and_retarget_offsets(it, leave);
+                    com::hresult::check(code->Remove(it));
+                    returns = true;
+                }
+                break;
+
+            case Cee_Jmp:
+            case Cee_Localloc:
+                protectable = false;
+                break;
+
+            default:
+                break;
+        }
+
+        it = next;
+    }
+
+    clrie::instruction_graph::iterator last = code.last_instruction();
+    const auto append = [&](const auto &instructions) {
+        for (const auto &i: instructions) {
+            code.insert_after(last, i);
+            last = i;
+        }
+    };
+
+    // Appends a fault handler for the block from first to last, made of the given code
+    // (which gets the endfinally ending the handler to branch to) and the endfinally.
+    const auto protect = [&](const auto &first, const auto &last, const auto &handler) {
+        const auto end = instr.create_instruction(Cee_Endfinally);
+        auto fault = handler(end);
+        fault += end;
+        append(fault);
+
+        com::ptr<IExceptionClause> clause;
+        com::hresult::check(method.exception_section()->AddNewExceptionClause(
+            COR_ILEXCEPTION_CLAUSE_FAULT, first, last, fault.front(), end, nullptr, mdTokenNil, &clause));
+    };
+
+    // Appends a handler catching anything thrown by the recorder's own code from first to last,
+    // such as ToString() of a captured value, which the app isn't meant to see. It drops
+    // the exception, runs the given code and leaves to after.
+    const auto swallow = [&](const auto &first, const auto &last, const auto &handler, const auto &after) {
+        clrie::instruction_factory::instruction_sequence code = { instr.create_instruction(Cee_Pop) };
+        code += handler;
+        const auto leave = instr.create_branch_instruction(Cee_Leave, after);
+        code += leave;
+        append(code);
+
+        com::ptr<IExceptionClause> clause;
+        com::hresult::check(method.exception_section()->AddNewExceptionClause(
+            COR_ILEXCEPTION_CLAUSE_NONE, first, last, code.front(), leave, nullptr, instr.object_type(), &clause));
+    };
+
+    // no call event means the call was made by the recorder and isn't recorded
+    const auto record_threw = [&](const auto &end) {
+        clrie::instruction_factory::instruction_sequence fault = {
+            instr.create_load_local_instruction(call_event_local),
+            instr.create_branch_instruction(Cee_Brfalse, end)
+        };
+        fault += instr.create_load_local_instruction(call_event_local);
+        fault += instr.make_call(method_threw);
+        return fault;
+    };
+
+    if (protectable) {
+        // A filter, which doesn't catch anything, tells the class of the exception before
+        // the stack is unwound and the fault handler records the call as thrown. Filters and
+        // faults can't share a protected block, so the filter's is nested in the fault's.
+        const auto body_last = last;
+        clrie::instruction_factory::instruction_sequence filter = instr.create_call_to_get_type_name();
+        filter += instr.pin_string();
+        filter += instr.create_load_local_instruction(call_event_local);
+        filter += instr.make_call(exception_thrown);
+        filter += instr.unpin_string();
+        filter += instr.create_int_operand_instruction(Cee_Ldc_I4, 0);
+        filter += instr.create_instruction(Cee_Endfilter);
+        const auto rethrow = instr.create_instruction(Cee_Rethrow);
+        clrie::instruction_factory::instruction_sequence handler = { instr.create_instruction(Cee_Pop), rethrow };
+        append(filter);
+        append(handler);
+
+        // the filter is given by its first instruction, and ends where its handler starts
+        com::ptr<IExceptionClause> clause;
+        com::hresult::check(method.exception_section()->AddNewExceptionClause(
+            COR_ILEXCEPTION_CLAUSE_FILTER, body, body_last, handler.front(), rethrow, filter.front(), mdTokenNil, &clause));
+
+        protect(body, rethrow, record_threw);
+    }
+
+    if (captures_block)
+        swallow(captures_block->first, captures_block->second, instr.make_call(capture_abandoned), body);
+
+    if (returns && protect_epilogue) {
+        // The return value is captured in a protected block, which has to be left
+        // with an empty stack, so it's loaded again to be returned after it.
+        // If capturing it throws, the call is recorded as returning without it.
+        const auto done = instr.create_load_local_instruction(*result_local);
+        clrie::instruction_factory::instruction_sequence exit_block = { exit };
+        exit_block += instr.create_load_local_instruction(*result_local);
+        exit_block += epilogue();
+        exit_block += instr.create_instruction(Cee_Pop);
+        const auto leave = instr.create_branch_instruction(Cee_Leave, done);
+        exit_block += leave;
+        append(exit_block);
+        clrie::instruction_factory::instruction_sequence returned = { instr.create_load_local_instruction(call_event_local) };
+        returned += instr.make_call(method_returned_void);
+        swallow(exit, leave, returned, done);
+        append(clrie::instruction_factory::instruction_sequence{ done, instr.create_instruction(Cee_Ret) });
+    } else if (returns) {
+        clrie::instruction_factory::instruction_sequence exit_block = { exit };
+        if (result_local)
+            exit_block += instr.create_load_local_instruction(*result_local);
+        exit_block += epilogue();
+        exit_block += instr.create_instruction(Cee_Ret);
+        append(exit_block);
+    }
 }
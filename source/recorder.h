@@ -10,11 +10,24 @@
 #include "event.h"
 
 namespace appmap {
+    struct module_plan;
+
     using recording = std::vector<std::unique_ptr<event>>;
 
     namespace recorder {
         extern appmap::recording events;
         inline std::mutex mutex;
-        void instrument(clrie::method_info method);
+        // The plan of the method's module, if any, caches names of methods across runs.
+        void instrument(clrie::method_info method, const module_plan *plan = nullptr);
+
+        // Adds an event which is always kept, such as of an HTTP request, to the recording,
+        // along with any calls it's nested in that are still staged (see config::min_duration).
+        void record(std::unique_ptr<event> event);
+
+        // Marks the thread as running managed code on behalf of the recorder (such as
+        // ToString() of a captured value), so that instrumented methods called from there
+        // aren't recorded. Returns true if the thread was already marked.
+        bool enter_capture();
+        void leave_capture();
     }
 }
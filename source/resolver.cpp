@@ -44,7 +44,7 @@ auto hook_resolver = add_hook("AppMap.ResolveAssembly", [](const auto &method)
     return true;
 });
 
-clrie::instruction_factory::instruction_sequence inject(instrumentation i)
+clrie::instruction_factory::instruction_sequence inject(const instrumentation &i)
 {
     clrie::instruction_factory::instruction_sequence code;
 
@@ -55,9 +55,11 @@ clrie::instruction_factory::instruction_sequence inject(instrumentation i)
     const auto ResolveEventHandler = i.type_reference(SystemRuntime, u"System.ResolveEventHandler");
 
     const auto sigResolver = sig::static_method(Assembly, {sig::object, ResolveEventArgs});
-    const auto Resolver = i.metadata.get(&IMetaDataEmit::DefineMethod,
-        mdTokenNil, u"AppMap.ResolveAssembly", mdPublic | mdStatic,
-        sigResolver.data(), sigResolver.size(), i.method.code_rva(), miIL | miManaged);
+    const auto Resolver = i.define([&](const auto &metadata) {
+        return metadata.get(&IMetaDataEmit::DefineMethod,
+            mdTokenNil, u"AppMap.ResolveAssembly", mdPublic | mdStatic,
+            sigResolver.data(), sigResolver.size(), i.method.code_rva(), miIL | miManaged);
+    });
 
 
     code += i.create_token_operand_instruction(Cee_Call, i.member_reference(
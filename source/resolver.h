@@ -8,6 +8,6 @@
 
 namespace appmap { namespace resolver {
 
-clrie::instruction_factory::instruction_sequence inject(instrumentation);
+clrie::instruction_factory::instruction_sequence inject(const instrumentation &);
 
 }}
@@ -2,14 +2,28 @@
 
 using namespace appmap;
 
-std::string appmap::friendly_name(const clrie::type &t)
+std::string appmap::friendly_name(const clrie::type &t, type_name_cache *cache)
 {
     switch (t.cor_element_type()) {
         case ELEMENT_TYPE_SZARRAY: {
             auto related = t.as<ICompositeType>().get(&ICompositeType::GetRelatedType);
-            return friendly_name(std::move(related)) + "[]";
+            return friendly_name(std::move(related), cache) + "[]";
         }
+        case ELEMENT_TYPE_CLASS:
+        case ELEMENT_TYPE_VALUETYPE:
+            if (cache)
+                return (*cache)(t);
+            [[fallthrough]];
         default:
             return t.name();
     }
 }
+
+interned_string type_name_cache::operator()(const clrie::type &t)
+{
+    const auto token = t.as<ITokenType>().get(&ITokenType::GetToken);
+    if (const auto name = names.find(token))
+        return *name;
+    // two threads might both look the name up, but they get the same string
+    return names.insert_or_assign(token, t.name());
+}
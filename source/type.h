@@ -4,8 +4,20 @@
 
 #include <string>
 
+#include "concurrent.h"
+#include "intern.h"
+
 namespace appmap {
 
-std::string friendly_name(const clrie::type &t);
+// Friendly names of the types of a single module, by their tokens,
+// since building the name of a type takes a few metadata lookups.
+class type_name_cache
+{
+    concurrent_map<mdToken, interned_string> names;
+public:
+    interned_string operator()(const clrie::type &t);
+};
+
+std::string friendly_name(const clrie::type &t, type_name_cache *cache = nullptr);
 
 }
@@ -0,0 +1,104 @@
+#include "utf16.h"
+
+#include <cstring>
+#include <doctest/doctest.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace appmap::utf16 {
+
+namespace {
+    constexpr bool is_high_surrogate(char16_t c) { return c >= 0xd800 && c < 0xdc00; }
+    constexpr bool is_low_surrogate(char16_t c) { return c >= 0xdc00 && c < 0xe000; }
+
+    // Copies the longest ASCII-only prefix, several code units at a time.
+    // Returns the number of code units consumed.
+    size_t copy_ascii(const char16_t *in, size_t size, char *out)
+    {
+        size_t i = 0;
+
+#if defined(__SSE2__)
+        const auto non_ascii = _mm_set1_epi16(static_cast<short>(0xff80));
+        for (; i + 8 <= size; i += 8) {
+            const auto units = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+            const auto high = _mm_and_si128(units, non_ascii);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xffff)
+                break;
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(out + i), _mm_packus_epi16(units, units));
+        }
+#endif
+
+        for (; i + 4 <= size; i += 4) {
+            uint64_t units;
+            std::memcpy(&units, in + i, sizeof(units));
+            if (units & 0xff80ff80ff80ff80)
+                break;
+            for (size_t j = 0; j < 4; j++)
+                out[i + j] = static_cast<char>(in[i + j]);
+        }
+
+        return i;
+    }
+}
+
+std::string to_utf8(std::u16string_view text)
+{
+    // each code unit yields at most three bytes; a surrogate pair yields four
+    std::string result(text.size() * 3, '\0');
+    char *out = result.data();
+    const char16_t *in = text.data();
+    const size_t size = text.size();
+
+    size_t i = 0;
+    while (i < size) {
+        const auto ascii = copy_ascii(in + i, size - i, out);
+        i += ascii;
+        out += ascii;
+
+        // handle code units one by one up to and including the next ASCII one
+        for (; i < size; i++) {
+            uint32_t c = in[i];
+
+            if (c < 0x80) {
+                *out++ = static_cast<char>(c);
+                i++;
+                break;
+            } else if (c < 0x800) {
+                *out++ = static_cast<char>(0xc0 | (c >> 6));
+                *out++ = static_cast<char>(0x80 | (c & 0x3f));
+                continue;
+            } else if (is_high_surrogate(c) && i + 1 < size && is_low_surrogate(in[i + 1])) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (in[++i] - 0xdc00);
+                *out++ = static_cast<char>(0xf0 | (c >> 18));
+                *out++ = static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+                *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+                *out++ = static_cast<char>(0x80 | (c & 0x3f));
+                continue;
+            } else if (is_high_surrogate(c) || is_low_surrogate(c)) {
+                c = 0xfffd;
+            }
+
+            *out++ = static_cast<char>(0xe0 | (c >> 12));
+            *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+            *out++ = static_cast<char>(0x80 | (c & 0x3f));
+        }
+    }
+
+    result.resize(out - result.data());
+    return result;
+}
+
+TEST_CASE("UTF-16 to UTF-8 conversion") {
+    CHECK(to_utf8(u"") == "");
+    CHECK(to_utf8(u"hello") == "hello");
+    CHECK(to_utf8(u"a fairly long ASCII string to go through the fast path") == "a fairly long ASCII string to go through the fast path");
+    CHECK(to_utf8(u"zażółć gęślą jaźń") == "zażółć gęślą jaźń");
+    CHECK(to_utf8(u"ASCII prefix then € and then ASCII again 0123456789") == "ASCII prefix then € and then ASCII again 0123456789");
+    CHECK(to_utf8(u"🦜 parrot") == "🦜 parrot");
+    CHECK(to_utf8(std::u16string{u'a', 0xd83e, u'b'}) == "a\xef\xbf\xbd" "b");
+    CHECK(to_utf8(std::u16string{0xdd9c}) == "\xef\xbf\xbd");
+}
+
+}
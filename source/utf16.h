@@ -0,0 +1,11 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace appmap { namespace utf16 {
+
+// Converts UTF-16 to UTF-8; unpaired surrogates are replaced with U+FFFD.
+std::string to_utf8(std::u16string_view text);
+
+}}
@@ -12,16 +12,18 @@ using namespace appmap;
 namespace sig = appmap::signature;
 namespace appmap { namespace web_framework {
     auto request(const char *method, const char *path_info) {
+        recorder::leave_capture();
         spdlog::trace("request({}, {})", method, path_info);
         auto call = std::make_unique<http_request_event>(current_thread_id(), method, path_info);
         call_event *ptr = call.get();
-        recorder::events.push_back(std::move(call));
+        recorder::record(std::move(call));
         return ptr;
     }
 
     void response(const call_event *parent, int code) {
+        recorder::leave_capture();
         spdlog::trace("response({})", code);
-        recorder::events.push_back(std::make_unique<http_response_event>(current_thread_id(), parent, code));
+        recorder::record(std::make_unique<http_response_event>(current_thread_id(), parent, code));
     }
 
     auto asp_net_build = add_hook(
@@ -59,15 +61,25 @@ namespace appmap { namespace web_framework {
                     ldarg{0}, ldarg{2}, stfld{ResponseWrapperContext}
                 });
 
+            // if a getter run on behalf of the recorder throws, the thread stops capturing
+            const std::vector<cil::instruction> leave_capture = {
+                ldc{recorder::leave_capture}, calli{instr.native_type(recorder::leave_capture)}
+            };
+
             const auto ResponseWrapperInvoke = instr.define_method(ResponseWrapper,
-                u"Invoke", sig::method(sig::Void, {Task}),
+                u"Invoke", sig::method(sig::Void, {Task}), {},
                 {
+                    // the status code getter runs on behalf of the recorder
+                    ldc{recorder::enter_capture}, calli{instr.native_type(recorder::enter_capture)}, pop,
+
                     ldarg{0}, ldfld{ResponseWrapperCall},
                     ldarg{0}, ldfld{ResponseWrapperContext},
                     callvirt{instr.member_reference(HttpContext, u"get_Response", sig::method(HttpResponse, {}))},
                     callvirt{instr.member_reference(HttpResponse, u"get_StatusCode", sig::method(sig::int32, {}))},
                     ldc{response}, calli{instr.native_type(response)}
-                });
+                },
+                leave_capture,
+                {});
 
             const auto RequestWrapper = instr.define_type(u"AppMap.AspNetCore.RequestWrapper");
             const auto RequestWrapperNext = instr.define_field(RequestWrapper, u"next", sig::field(RequestDelegate));
@@ -79,14 +91,19 @@ namespace appmap { namespace web_framework {
             const auto RequestWrapperInvoke = instr.define_method(RequestWrapper,
                 u"Invoke", sig::method(Task, {HttpContext}), {sig::native_int},
                 {
+                    // so do the request getters, until request() leaves capture
+                    ldc{recorder::enter_capture}, calli{instr.native_type(recorder::enter_capture)}, pop,
+
                     ldarg{1}, callvirt{HttpContext_get_Request},
                     callvirt{instr.member_reference(HttpRequest, u"get_Method", sig::method(sig::string, {}))},
 
                     ldarg{1}, callvirt{HttpContext_get_Request},
                     callvirt{instr.member_reference(HttpRequest, u"get_Path", sig::method(sig::value{PathString}, {}))},
 
-                    ldc{request}, calli{instr.native_type(request)}, stloc{0},
-
+                    ldc{request}, calli{instr.native_type(request)}, stloc{0}
+                },
+                leave_capture,
+                {
                     ldarg{0}, ldfld{RequestWrapperNext}, ldarg{1},
                     callvirt{instr.member_reference(RequestDelegate, u"Invoke", sig::method(Task, {HttpContext}))},
 
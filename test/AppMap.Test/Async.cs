@@ -0,0 +1,58 @@
+using System;
+using System.Collections.Concurrent;
+using System.Threading;
+using System.Threading.Tasks;
+using Xunit;
+
+namespace AppMap.Test
+{
+    namespace Code {
+        public class Async {
+            public static async Task<int> Increment(int value) {
+                await Task.Yield();
+                return value + 1;
+            }
+
+            public static async Task<T> Generic<T>(T value) {
+                await Task.Yield();
+                return value;
+            }
+        }
+    }
+
+    // Runs continuations on the thread running the test, so that
+    // the calls return on the same thread whatever the thread pool does.
+    class SingleThreadContext : SynchronizationContext
+    {
+        private readonly BlockingCollection<(SendOrPostCallback, object?)> queue = new();
+
+        public override void Post(SendOrPostCallback d, object? state) => queue.Add((d, state));
+
+        public static void Run(Func<Task> func)
+        {
+            var previous = Current;
+            var context = new SingleThreadContext();
+            SetSynchronizationContext(context);
+            try {
+                var task = func();
+                task.ContinueWith(_ => context.queue.CompleteAdding(), TaskScheduler.Default);
+                foreach (var (d, state) in context.queue.GetConsumingEnumerable())
+                    d(state);
+                task.GetAwaiter().GetResult();
+            } finally {
+                SetSynchronizationContext(previous);
+            }
+        }
+    }
+
+    public class AsyncTest {
+        [Fact]
+        public void Yielding()
+        {
+            SingleThreadContext.Run(async () => {
+                Console.WriteLine(await Code.Async.Increment(1));
+                Console.WriteLine(await Code.Async.Generic("generic"));
+            });
+        }
+    }
+}
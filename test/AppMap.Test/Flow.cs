@@ -20,6 +20,24 @@ namespace AppMap.Test
                 Console.WriteLine(value.ToString());
             }
         }
+
+        public class Returns {
+            public static int Sign(int value)
+            {
+                if (value < 0)
+                    return -1;
+                if (value > 0)
+                    return 1;
+                return 0;
+            }
+
+            public static int Length(string text)
+            {
+                if (text.Length == 0)
+                    throw new ArgumentException("empty text", nameof(text));
+                return text.Length;
+            }
+        }
     }
 
     public class FlowTest {
@@ -30,5 +48,20 @@ namespace AppMap.Test
             Code.DisablableConsole.Write(new object());
             Code.DisablableConsole.Write("something else");
         }
+
+        [Fact]
+        public void MultipleReturns()
+        {
+            Console.WriteLine(Code.Returns.Sign(-5));
+            Console.WriteLine(Code.Returns.Sign(5));
+            Console.WriteLine(Code.Returns.Sign(0));
+        }
+
+        [Fact]
+        public void Throwing()
+        {
+            Assert.Throws<ArgumentException>(() => Code.Returns.Length(""));
+            Console.WriteLine(Code.Returns.Length("text"));
+        }
     }
 }
@@ -16,5 +16,14 @@ Dir["#{DIR}/**/*.appmap.json"].each do |file|
     thread_clause.gsub(/\d+/, threads)
   end
 
+  object_seq = 0
+  objects = Hash.new do |h, oid|
+    h[oid] = (object_seq += 1)
+  end
+
+  text.gsub!(/"object_id":\s*-?\d+/) do |object_clause|
+    object_clause.gsub(/-?\d+/, objects)
+  end
+
   File.write file, text
 end